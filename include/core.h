@@ -2,35 +2,132 @@
 #include <cpu.h>
 #include <bus.h>
 #include <condition_variable>
+#include <functional>
+#include <future>
 #include <mutex>
 #include <atomic>
 #include <scheduler.h>
+#include <ringbuffer.h>
+
+// One LCD frame, 154 lines of 456 cycles, and how long it takes on real hardware (~59.73 Hz)
+constexpr u64 CYCLES_PER_FRAME = 70224;
+constexpr u64 FRAME_PERIOD_NS = CYCLES_PER_FRAME * 1000000000 / 4194304;
 
 namespace natsukashii::core
 {
+// Written by the emu thread once per frame, read by the UI
+struct PacingStats
+{
+  std::atomic<float> buffer_ms = 0;
+  std::atomic<float> error_ms = 0;
+  std::atomic<float> ratio = 1;
+  std::atomic<u32> underruns = 0;
+  // Emulated speed relative to real hardware, smoothed over a few frames
+  std::atomic<float> speed = 1;
+  // Frame-skip watchdog: smoothed emulation work per frame, without pacing sleeps, and frames skipped
+  std::atomic<float> work_ms = 0;
+  std::atomic<u32> skipped = 0;
+};
+
+enum class Command
+{
+  Pause,
+  Reset,
+  Stop,
+  LoadROM,
+  SaveState,
+  LoadState,
+  Quit,
+};
+
+// A control request from the UI, carried out by the emu thread between two frames
+struct CommandRequest
+{
+  Command command;
+  std::string path;
+  int slot = 0;
+  std::promise<void> done;
+};
+
 struct Core
 {
   Core(bool skip, std::string bootrom_path);
-  void Run();
-  void Reset();
-  void Pause();
-  void Stop();
-  void LoadROM(std::string path);
-  void SaveState(int slot);
-  void LoadState(int slot);
-
-  [[noreturn]] void RunAsync();
-  void WaitPing();
+  ~Core();
+  void RunFrame();
+
+  // UI thread: these only queue the command and wake the emu thread, which runs it at the next
+  // frame boundary, so Cpu/Bus state is only ever touched by one thread. The future is ready once it ran
+  std::future<void> Reset();
+  std::future<void> Pause();
+  std::future<void> Stop();
+  std::future<void> LoadROM(std::string path);
+  std::future<void> SaveState(int slot);
+  std::future<void> LoadState(int slot);
+  // Stops like Stop and makes RunAsync return, join the emu thread after this
+  std::future<void> Quit();
+  std::future<void> Post(Command command, std::string path = "", int slot = 0);
+  // Emu thread, between frames: the whole machine to and from memory, around 30 KiB and a few
+  // microseconds, cheap enough for a state every frame. Deserialize refuses states of another
+  // version, game or size without touching anything. out is reused, keep it around
+  void Serialize(std::vector<u8>& out);
+  bool Deserialize(const u8* data, size_t size);
+  // Slots on disk are a serialized state as is
+  std::string SlotPath(int slot);
+  void SaveSlot(int slot);
+  void LoadSlot(int slot);
+  std::vector<u8> slot_buffer;
+  // Emu thread
+  void ExecuteCommands();
+  void Execute(CommandRequest& request);
+  RingBuffer<CommandRequest*> commands{64};
+  // Called on the emu thread once a batch of commands ran, so a UI that sleeps until something
+  // changes picks up the new pause/init state. Set before RunAsync starts
+  std::function<void()> on_command;
+
+  // Emu thread loop: runs frames paced by the audio device and only sleeps while there's nothing to run
+  // and no command to execute.
+  // Finished frames reach the UI through bus.ppu.frames, the UI never has to wait for it.
+  // Returns once a Quit command ran
+  void RunAsync();
+  void PaceToAudio();
+  bool Turbo() const { return turbo_hold || turbo_unlimited; }
+  // Skips rendering (not emulation or audio) while the host can't keep up
+  void Watchdog(float work_ms);
+  void WaitRunnable();
+  void Wake();
   void DispatchEvents();
+  void ResetScheduler();
+
+  // UI thread: queues a press/release for the frame currently being emulated. QueueInput takes any
+  // target cycle, which is what makes replays land on the same cycle every time. host_time is only
+  // carried through to the frame that shows the input, see TripleBuffer::FrontTag
+  void PressButton(u8 button, bool pressed, u64 host_time = 0);
+  void QueueInput(const InputEvent& event);
+  // Emu thread: moves queued events into pending and schedules the next Event::Joypad
+  void PollInputs();
+  void DispatchInputs(u64 time);
+  RingBuffer<InputEvent> inputs{256};
+  std::vector<InputEvent> pending;
+  bool joypad_scheduled = false;
+  // Cycle count at the start of the frame being emulated, what PressButton stamps events with
+  std::atomic<u64> frame_cycles = 0;
   std::condition_variable emu_condition_variable;
   std::mutex emu_mutex;
-  std::atomic <bool> run_emu_thread = false;
+  PacingStats stats;
   Scheduler scheduler;
   Bus bus;
   Cpu cpu;
-  int key;
   u64 cycles = 0;
-  bool pause = false;
-  bool init = false;
+  std::atomic<bool> pause = false;
+  std::atomic<bool> init = false;
+  // Emu thread, set by Command::Quit
+  bool quit = false;
+  // Fast-forward, while the key is held or until toggled off. The emu thread runs flat out and
+  // only renders the frames the UI asks for. Audio is muted or decimated to whole frames that
+  // keep the device fed, offline sinks still get everything
+  std::atomic<bool> turbo_hold = false;
+  std::atomic<bool> turbo_unlimited = false;
+  bool turbo_mute = false;
+  u32 dropped_in_a_row = 0;
 };
 }  // namespace natsukashii::core
\ No newline at end of file
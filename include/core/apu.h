@@ -3,20 +3,65 @@
 #include "ch2.h"
 #include "ch3.h"
 #include "ch4.h"
-#define SDL_MAIN_HANDLED
-#include <SDL2/SDL.h>
-
-constexpr int FREQUENCY = 48000;
-constexpr int CHANNELS = 2;
-constexpr int SAMPLES = 4096;
+#include "blip.h"
+#include "audiosink.h"
+#include <scheduler.h>
+#include <savestate.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace natsukashii::core
 {
+// Longest stretch between two EndFrames the resamplers are sized for. Frames are 70224 clocks plus
+// the rest of the instruction that ended them, this leaves plenty of room
+constexpr u32 MAX_FRAME_CLOCKS = 70224 * 2;
+
+// What the CPU side of an offloaded APU sends to the worker, times are clocks since the last EndFrame
+enum class ApuLogKind : u8 {
+	Write,
+	Sequencer,
+	EndFrame,
+	Reset,
+};
+
+struct ApuLogEntry {
+	u32 time;
+	ApuLogKind kind;
+	u8 reg;
+	u8 value;
+	float ratio;
+};
+
 struct Apu {
 	~Apu();
 	explicit Apu(bool skip);
 	void Reset();
+	void PowerOnDefaults();
+	// Only advances the APU clock, channels are run lazily up to it whenever something changes
 	void Step(u8 cycles);
+	void RunUntil(u32 time);
+	// Frame sequencer tick, an Event::APU entry every 8192 cycles (512 Hz). now is the current
+	// cycle count, which may have run past time by the rest of the instruction
+	void DispatchEvents(u64 time, u64 now, Scheduler& scheduler);
+	void StepFrameSequencer();
+	void UpdateGains();
+	// Runs the channels to the end of the frame, resamples and queues the result to the sink.
+	// Without output the samples are still made, the synthesis state has to stay continuous
+	void EndFrame(bool output = true);
+	// Only while the emu thread isn't running, the sink outlives resets
+	void SetSink(std::unique_ptr<AudioSink> new_sink);
+	// Offloaded, this Apu keeps only the state the CPU can read back (registers, length, sweep,
+	// NR52) and appends every write and sequencer tick to a lock-free log. A worker Apu replays the
+	// log on its own thread and does all the synthesis. Also only while the emu thread isn't running
+	void SetOffload(bool enable);
+	// The sink samples end up in, whichever Apu feeds it
+	AudioSink& Output();
+	// Channel and mixer registers, only between frames. Inline, whatever is still in the resampler
+	// keeps playing and the loaded channels continue from there. Offloaded, LoadState restarts the
+	// worker: it first finishes what it was sent, the new one starts from an empty resampler
+	void SaveState(StateWriter& state);
+	void LoadState(StateReader& state);
 
 	CH1 ch1;
 	CH2 ch2;
@@ -28,13 +73,33 @@ struct Apu {
 	u8 nr51{};
 	u8 ReadIO(u16 addr);
 	void WriteIO(u16 addr, u8 val);
+	void WriteRegister(u16 addr, u8 val);
 	bool skip;
-	u32 sample_clock = 0;
-	float buffer[SAMPLES * 2]{};
-	SDL_AudioDeviceID device;
-	int buffer_pos = 0;
+	float buffer[SAMPLES * 4]{};
+	std::unique_ptr<AudioSink> sink = std::make_unique<NullSink>();
+	// Output samples per emulated second = sample_rate * resample_ratio, nudged by the pacer.
+	// sample_rate is whatever the sink actually runs at, FREQUENCY is only what we ask for
+	int sample_rate = FREQUENCY;
+	double resample_ratio = 1.0;
+
+	// Clocks since the last EndFrame, and how far the channels have been run
+	u32 frame_time = 0;
+	u32 last_time = 0;
+	Blip left{MAX_FRAME_CLOCKS}, right{MAX_FRAME_CLOCKS};
+	BlipOutput outputs[4];
 
 	u8 frame_sequencer_position = 0;
 	bool apu_enabled = false;
+
+	// Offload mode, see SetOffload
+	void Log(ApuLogEntry entry);
+	void Replay(const ApuLogEntry& entry);
+	void ReplayLoop();
+	std::unique_ptr<Apu> worker;
+	std::unique_ptr<RingBuffer<ApuLogEntry>> log;
+	std::atomic<bool> worker_running = false;
+	std::mutex worker_mutex;
+	std::condition_variable worker_cv;
+	std::thread worker_thread;
 };
 } // natsukashii::core
\ No newline at end of file
@@ -0,0 +1,82 @@
+#pragma once
+#include "util.h"
+#include "ringbuffer.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+constexpr int FREQUENCY = 48000;
+constexpr int CHANNELS = 2;
+constexpr int SAMPLES = 1024;
+// How much queued audio the emulator is paced to, in sample frames
+constexpr int AUDIO_TARGET = SAMPLES * 2;
+
+namespace natsukashii::core
+{
+// Where the APU's interleaved float frames end up. Push is called once per emulated frame from the
+// emu thread, or the APU worker when offloaded. Realtime sinks must never block in it, offline ones
+// may apply backpressure and stall the caller until there is room (WavSink does, a capture must not
+// have gaps). Queued is what the pacer keeps at AUDIO_TARGET, sinks that don't play in real time say
+// so and the emulator then runs unthrottled
+struct AudioSink
+{
+  virtual ~AudioSink() = default;
+  virtual int SampleRate() const = 0;
+  virtual void Push(const float* samples, size_t frames) = 0;
+  virtual u32 Queued() = 0;
+  virtual bool Realtime() const { return true; }
+  virtual u32 Underruns() const { return 0; }
+};
+
+// The sound card lives with the frontend, see sdlsink.h, so the core doesn't depend on SDL
+
+// Discards everything but drains at FREQUENCY by wall clock, so a headless box still runs at full speed
+// and not flat out. Push and Queued may come from different threads when the APU is offloaded
+class NullSink : public AudioSink
+{
+public:
+  int SampleRate() const override { return FREQUENCY; }
+  void Push(const float* samples, size_t frames) override;
+  u32 Queued() override;
+private:
+  void Drain();
+  using clock = std::chrono::steady_clock;
+  std::mutex mutex;
+  clock::time_point last = clock::now();
+  double queued = 0;
+};
+
+// Streams 32-bit float stereo to a RIFF/WAVE file. The emu thread only fills a ring, a writer thread
+// does the disk I/O, so faster than real time runs can be captured. A capture with gaps is useless, so
+// when the disk can't keep up Push waits for room instead of dropping. Sizes in the header are patched on close
+class WavSink : public AudioSink
+{
+public:
+  // nullptr if the file can't be created
+  static std::unique_ptr<WavSink> Open(const std::string& path);
+  ~WavSink() override;
+  int SampleRate() const override { return FREQUENCY; }
+  void Push(const float* samples, size_t frames) override;
+  u32 Queued() override { return 0; }
+  bool Realtime() const override { return false; }
+private:
+  explicit WavSink(FILE* file);
+  void WriteHeader(u32 data_bytes);
+  void Writer();
+  FILE* file;
+  u64 data_bytes = 0;
+  // A few seconds of audio, enough to ride out slow disks even when running many times real time
+  RingBuffer<float> ring{FREQUENCY * CHANNELS * 4};
+  std::atomic<bool> running = true;
+  std::mutex mutex;
+  // Data for the writer, room for Push
+  std::condition_variable cv;
+  std::condition_variable space_cv;
+  std::thread thread;
+};
+} // natsukashii::core
@@ -0,0 +1,80 @@
+#pragma once
+#include "util.h"
+#include <vector>
+
+namespace natsukashii::core
+{
+// Band-limited step synthesis in the style of blip_buf: channels only report amplitude changes
+// (delta + clock timestamp), each change is added as a windowed-sinc impulse at the matching
+// output sample position, and the buffer is integrated into samples once per frame.
+// Cost follows the number of waveform transitions, not the number of cycles emulated.
+// The impulse table is a polyphase FIR, so this is also the resampler from the 4 MiHz clock to any
+// device rate, with the ratio adjustable between frames through set_rates
+class Blip
+{
+public:
+  static constexpr int WIDTH = 16;
+  // The top PHASE_BITS of the 32-bit fraction pick the phase, the rest interpolate to the next one
+  static constexpr int PHASE_BITS = 5;
+  static constexpr int PHASES = 1 << PHASE_BITS;
+
+  // Corner of the DC-blocking leak on the integrator, the same whatever the output rate
+  static constexpr double HIGHPASS_HZ = 15;
+
+  // max_clocks is the longest stretch between two end_frames, set_rates keeps the buffer big
+  // enough to hold that many clocks at whatever rate it is given. Call it before adding deltas
+  explicit Blip(u32 max_clocks);
+  void set_rates(double clock_rate, double sample_rate);
+  void clear();
+
+  // time is in clocks since the last end_frame
+  void add_delta(u32 time, int delta);
+  void end_frame(u32 time);
+
+  int samples_avail() const;
+  // Integrates count samples into out (every stride floats), scaled by scale, and removes them
+  int read_samples(float* out, int count, int stride, float scale);
+
+private:
+  // 32.32 fixed point output samples per clock and position of clock 0 of the current frame
+  u64 factor = 0;
+  u64 offset = 0;
+  u32 max_clocks;
+  float integrator = 0;
+  // Fraction of the integrator leaked per output sample, from HIGHPASS_HZ and the rate
+  float leak = 0;
+  std::vector<float> buffer;
+};
+
+// A channel's connection to the stereo buffers, turns amplitude changes into deltas.
+// Gains are the master volume + 1 on each side the channel is panned to, 0 otherwise
+struct BlipOutput
+{
+  Blip* left = nullptr;
+  Blip* right = nullptr;
+  int gain_left = 0, gain_right = 0;
+  int amp = 0;
+
+  // What every channel means by silent: DAC or channel off, a volume that outputs nothing, or panned
+  // to neither side. Silent channels output 0 and skip straight to where their position ends up
+  bool audible(bool dac, bool enabled, bool volume) const {
+    return dac && enabled && volume && (gain_left || gain_right);
+  }
+
+  void update(u32 time, int new_amp) {
+    if(new_amp != amp) {
+      int delta = new_amp - amp;
+      amp = new_amp;
+      if(gain_left) left->add_delta(time, delta * gain_left);
+      if(gain_right) right->add_delta(time, delta * gain_right);
+    }
+  }
+
+  void set_gains(u32 time, int new_left, int new_right) {
+    if(new_left != gain_left) left->add_delta(time, amp * (new_left - gain_left));
+    if(new_right != gain_right) right->add_delta(time, amp * (new_right - gain_right));
+    gain_left = new_left;
+    gain_right = new_right;
+  }
+};
+} // natsukashii::core
@@ -1,5 +1,6 @@
 #pragma once
 #include "mem.h"
+#include "blip.h"
 
 namespace natsukashii::core
 {
@@ -58,6 +59,7 @@ struct CH1
     {0, 1, 1, 1, 1, 1, 1, 0}
   };
 
+	// Clocks until the next duty step
 	s16 timer;
 
 	u8 sweep_period_timer;
@@ -71,13 +73,12 @@ struct CH1
 	void step_length();
 	void step_sweep();
 	void step_volume();
-	void tick();
+	void run(u32 time, u32 end_time, BlipOutput& out);
 
 	u8 current_volume;
 	u16 frequency;
 	u16 shadow_frequency;
 
-	u8 sample();
 	u16 calculate_frequency();
 };
 }
\ No newline at end of file
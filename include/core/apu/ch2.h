@@ -1,5 +1,6 @@
 #pragma once
 #include "mem.h"
+#include "blip.h"
 
 namespace natsukashii::core
 {
@@ -46,16 +47,16 @@ struct CH2
     {0, 1, 1, 1, 1, 1, 1, 0}
   };
 	
+	// Clocks until the next duty step
 	s16 timer;
 
 	u16 frequency = 0;
 	u8 length_counter = 0;
 	u8 dac = 0;
 
-  u8 sample();
 	void step_length();
 	void step_volume();
-	void tick();
+	void run(u32 time, u32 end_time, BlipOutput& out);
 
 	u8 period_timer, current_volume;
 
@@ -1,5 +1,6 @@
 #pragma once
 #include "mem.h"
+#include "blip.h"
 
 namespace natsukashii::core
 {
@@ -41,6 +42,7 @@ struct CH3
 	} nr34;
 
 	u16 frequency = 0;
+	// Clocks until the next wave step
 	s16 timer = 0;
 	u8 wave_ram[16];
 	u32 wave_pos = 0;
@@ -54,8 +56,7 @@ struct CH3
 	};
 
 	void step_length();
-	u8 sample();
-	void tick();
+	void run(u32 time, u32 end_time, BlipOutput& out);
 	u8 read(u16 addr);
 	void write(u16 addr, u8 val);
 };
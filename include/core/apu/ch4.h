@@ -1,5 +1,6 @@
 #pragma once
 #include "mem.h"
+#include "blip.h"
 
 namespace natsukashii::core
 {
@@ -47,7 +48,23 @@ struct CH4
 		u8 raw;
 	} nr44;
 	
-	u8 read(u16 addr) { return 0xff; }
-	void write(u16 addr, u8 val) { }
+	// Clocks until the next LFSR step, the period goes up to 112 << 13
+	u32 timer = 0;
+	u16 lfsr = 0x7fff;
+	u8 period_timer = 0;
+	u8 current_volume = 0;
+	u8 length_counter = 0;
+	bool dac = false;
+
+	constexpr static u8 divisors[8] = {
+		8, 16, 32, 48, 64, 80, 96, 112
+	};
+
+	u32 period() const { return divisors[nr43.ratio] << nr43.freq; }
+	void step_length();
+	void step_volume();
+	void run(u32 time, u32 end_time, BlipOutput& out);
+	u8 read(u16 addr);
+	void write(u16 addr, u8 val);
 };
 }
\ No newline at end of file
@@ -14,8 +14,8 @@ struct Bus
   u16 NextHalf(u16& pc, u8& cycles);
   void WriteHalf(u16 addr, u16 val);
   void LoadROM(std::string filename);
-  void SaveState(std::ofstream& savestate);
-  void LoadState(std::ifstream& loadstate);
+  void SaveState(StateWriter& state);
+  void LoadState(StateReader& state);
   void Reset();
   bool romopened = false;
   Mem mem;
@@ -10,8 +10,8 @@ public:
   Cpu(bool skip, Bus* bus);
   u8 Step();
   void Reset();
-  void SaveState(int slot);
-  void LoadState(int slot);
+  void SaveState(StateWriter& state);
+  void LoadState(StateReader& state);
   Bus* bus;
   bool halt = false;
   void DispatchTimers(u64 time, Scheduler& scheduler);
@@ -0,0 +1,46 @@
+#pragma once
+#include "util.h"
+#include <array>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+namespace natsukashii::core
+{
+// Lock-free triple buffer between the emulator and whoever displays the frames.
+// The PPU draws into the back buffer and publishes it once complete, the reader
+// swaps the newest published frame into the front buffer. Neither side ever waits
+struct TripleBuffer
+{
+  TripleBuffer() = default;
+
+  // Not thread safe, only call while nobody is drawing or reading
+  void Resize(size_t size);
+
+  u8* Back() { return buffers[back].data(); }
+  const u8* Front() const { return buffers[front].data(); }
+
+  // Writer side, hands the back buffer over and takes the spare one. The tag travels with the frame
+  // (the frontend's input timestamps), 0 for none. A tag on a frame the reader never acquired moves on
+  // to the one replacing it, so it is reported with the first frame that can actually be seen
+  void Publish(u64 tag = 0);
+  // Reader side, returns false and keeps the current front if nothing new was published
+  bool Acquire();
+  // The acquired frame's tag, 0 if it has none or it was already reported with an earlier frame
+  u64 FrontTag() const { return front_tag; }
+
+  // Called on the writer's thread after every Publish, lets a reader that sleeps between frames wake up.
+  // Set before anybody draws
+  std::function<void()> on_publish;
+
+private:
+  static constexpr u8 FRESH = 4;
+
+  std::array<std::vector<u8>, 3> buffers;
+  // Index of the spare buffer, FRESH is set while it holds a frame the reader hasn't seen
+  std::atomic<u8> middle = 1;
+  u8 back = 0, front = 2;
+  std::array<u64, 3> tags{};
+  u64 front_tag = 0, seen_tag = 0;
+};
+} // natsukashii::core
@@ -1,9 +1,13 @@
 #pragma once
 #include <array>
+#include <fstream>
 #include <iterator>
+#include <memory>
+#include <string>
 #include <vector>
 #include <map>
-#include "common.h"
+#include "util.h"
+#include "savestate.h"
 
 constexpr int BOOTROM_SZ = 0x100;
 constexpr int EXTRAM_SZ = 0x2000;
@@ -14,6 +18,25 @@ constexpr int ROM_SZ_MIN = 0x8000;
 namespace natsukashii::core
 {
 using namespace natsukashii::util;
+
+// Button state bits, set while held. The low nibble is what P1 reads with the buttons selected,
+// the high nibble with the d-pad selected
+enum Button : u8
+{
+  BUTTON_A = 1, BUTTON_B = 2, BUTTON_SELECT = 4, BUTTON_START = 8,
+  BUTTON_RIGHT = 16, BUTTON_LEFT = 32, BUTTON_UP = 64, BUTTON_DOWN = 128
+};
+
+// A press or release taking effect once the emulated clock reaches cycle
+struct InputEvent
+{
+  u64 cycle;
+  u8 button;
+  bool pressed;
+  // Host clock in ns when the key went down or up, 0 if untimed. Carried along for latency measurement only
+  u64 host_time = 0;
+};
+
 class Cart
 {
 public:
@@ -23,7 +46,9 @@ public:
   virtual void Save(const std::string& filename) { }
   virtual u8* GetROM() { }
   virtual u8* GetRAM() { }
-  virtual void SetRam(std::ifstream& rhs) { }
+  // Bank registers and RAM, everything that isn't the ROM
+  virtual void SaveState(StateWriter& state) { }
+  virtual void LoadState(StateReader& state) { }
 };
 
 class NoMBC : public Cart
@@ -35,7 +60,6 @@ public:
   void Save(const std::string& filename) override {}
   u8* GetROM() override { return rom.data(); }
   u8* GetRAM() override { u8 ram[EXTRAM_SZ]{0xff}; return ram; }
-  void SetRam(std::ifstream& rhs) override { }
 private:
   std::vector<u8> rom;
 };
@@ -49,9 +73,8 @@ public:
   void Save(const std::string& filename) override;
   u8* GetROM() override { return rom.data(); }
   u8* GetRAM() override { return ram.data(); }
-  void SetRam(std::ifstream& rhs) override {
-    rhs.read((char*)ram.data(), EXTRAM_SZ);
-  }
+  void SaveState(StateWriter& state) override;
+  void LoadState(StateReader& state) override;
 private:
   u8 romBank = 1;
   u8 ramBank = 1;
@@ -75,9 +98,8 @@ public:
   void Save(const std::string& filename) override;
   u8* GetROM() override { return rom.data(); }
   u8* GetRAM() override { return ram.data(); }
-  void SetRam(std::ifstream& rhs) override {
-    rhs.read((char*)ram.data(), EXTRAM_SZ);
-  }
+  void SaveState(StateWriter& state) override;
+  void LoadState(StateReader& state) override;
 private:
   u8 romBank = 1;
   bool ramEnable = false;
@@ -95,9 +117,8 @@ public:
   void Save(const std::string& filename) override;
   u8* GetROM() override { return rom.data(); }
   u8* GetRAM() override { return ram.data(); }
-  void SetRam(std::ifstream& rhs) override {
-    rhs.read((char*)ram.data(), EXTRAM_SZ);
-  }
+  void SaveState(StateWriter& state) override;
+  void LoadState(StateReader& state) override;
 private:
   u8 ramBank = 0;
   u8 romBank = 0;
@@ -116,9 +137,8 @@ public:
   void Save(const std::string& filename) override;
   u8* GetROM() override { return rom.data(); }
   u8* GetRAM() override { return ram.data(); }
-  void SetRam(std::ifstream& rhs) override {
-    rhs.read((char*)ram.data(), EXTRAM_SZ);
-  }
+  void SaveState(StateWriter& state) override;
+  void LoadState(StateReader& state) override;
 private:
   u16 romBank = 1;
   u8 ramBank = 1;
@@ -133,8 +153,10 @@ public:
   ~Mem();
   Mem(bool skip, std::string bootrom_path);
   void LoadROM(std::string filename);
-  void SaveState(std::ofstream& savestate);
-  void LoadState(std::ifstream& loadstate);
+  void SaveState(StateWriter& state);
+  void LoadState(StateReader& state);
+  // The cartridge header's global checksum, tells savestates of different games apart
+  u16 RomChecksum() const;
   void Reset();
   u8 Read(u16 addr);
   void Write(u16 addr, u8 val);
@@ -178,7 +200,11 @@ public:
   friend class Ppu;
   friend class Bus;
   bool rom_opened = false;
-  void DoInputs(int key);
+  // Applies a press/release to the button state and raises the joypad interrupt on a falling P1 line
+  void SetButton(u8 button, bool pressed, u64 host_time = 0);
+  u8 buttons = 0;
+  // Host time of the oldest timed input applied since the game last read P1, 0 if none
+  u64 unread_input = 0;
   std::string savefile;
 private:
   bool held = false;
@@ -197,5 +223,6 @@ private:
   bool button = false;
 
   void HandleJoypad(u8 val);
+  void UpdateJoypad();
 };
 }  // namespace natsukashii::core
\ No newline at end of file
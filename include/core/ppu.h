@@ -1,6 +1,16 @@
 #pragma once
+#include <atomic>
+#include <bitset>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <mem.h>
 #include <scheduler.h>
+#include <framebuffer.h>
+#include <ringbuffer.h>
+#include <savestate.h>
 
 constexpr int VRAM_SZ = 0x2000;
 constexpr int OAM_SZ = 0xa0;
@@ -9,6 +19,27 @@ constexpr int HEIGHT = 144;
 constexpr int FBSIZE = WIDTH * HEIGHT;
 constexpr u32 colors[4] = { 0xFED018FF, 0xD35600FF, 0x5E1210FF, 0x0D0405FF };
 
+// Framebuffer layouts: RGBA is a u32 per pixel from colors[], Shade8 one shade index (0-3)
+// per byte and Shade2bpp four shade indices per byte, leftmost pixel in the top bits
+enum class PixelFormat
+{
+  RGBA,
+  Shade8,
+  Shade2bpp
+};
+
+constexpr size_t FrameSize(PixelFormat format)
+{
+  switch (format)
+  {
+  case PixelFormat::RGBA: return FBSIZE * sizeof(u32);
+  case PixelFormat::Shade8: return FBSIZE;
+  case PixelFormat::Shade2bpp: return FBSIZE / 4;
+  }
+
+  return 0;
+}
+
 namespace natsukashii::core
 {
 struct Sprite
@@ -39,24 +70,78 @@ public:
   Attributes attribs;
 };
 
+// What the emu thread sends to the render worker, in the order it happened
+enum class PpuLogKind : u8
+{
+  Vram,
+  Oam,
+  Line,
+  Publish,
+  Reset
+};
+
+struct PpuLogEntry
+{
+  PpuLogKind kind;
+  u8 val;
+  u16 addr;
+  // Line only, the registers as that scanline saw them
+  u8 ly, scy, scx, wy, wx, lcdc, bgp, obp0, obp1, window_counter;
+  // Publish only, the frame's tag
+  u64 input_time;
+};
+
 class Ppu
 {
 public:
   explicit Ppu(bool skip);
+  ~Ppu();
   void Reset();
-  void SaveState(std::ofstream& savestate);
-  void LoadState(std::ifstream& loadstate);
+  void SaveState(StateWriter& state);
+  void LoadState(StateReader& state);
+
+  void SetPixelFormat(PixelFormat format);
+  PixelFormat GetPixelFormat() const { return pixel_format; }
 
-  u32 pixels[FBSIZE]{0x0D0405FF};
+  // Finished frames are published here at VBlank, readers Acquire() and use Front()
+  TripleBuffer frames;
   u8 vram[VRAM_SZ]{0};
   u8 oam[OAM_SZ]{0};
 
   friend class Bus;
-  bool render = false;
 
   void DispatchEvents(u64 time, Scheduler& scheduler, u8& intf);
 
+  // Render-skip: only every Nth frame is drawn, 0 draws nothing but requested frames.
+  // Skipped frames keep the exact mode/STAT/LY/interrupt timing, they just produce no pixels
+  void SetRenderInterval(u32 n) { render_interval = n; }
+  void RequestFrame() { frame_requested = true; }
+  // Frame-skip watchdog: while set, frames aren't drawn even when due or requested
+  void SetDropFrames(bool drop) { drop_frames = drop; }
+  u64 frame_count = 0;
+  u64 frames_dropped = 0;
+
+  // Offloaded, the emu thread does no pixel work: each drawn line only snapshots the registers
+  // into a log, along with VRAM/OAM writes, and a worker Ppu replays it on its own thread and
+  // publishes to frames. Frames show up within the next emulated frame instead of at VBlank.
+  // Only while the emu thread isn't running
+  void SetRenderOffload(bool enable);
+
+  // Beam racing: called with every drawn scanline once mode 3 is over, row points at that line of the
+  // back buffer in the current pixel format. Runs on whichever thread draws, so offloaded the lines
+  // come from the worker and only as fast as it catches up. Only while the emu thread isn't running
+  using LineCallback = std::function<void(u8 ly, const u8* row)>;
+  void SetLineCallback(LineCallback callback);
+
+  // The game read P1 after an input with this host time was applied. The next drawn frame is
+  // published tagged with the oldest such time
+  void InputRead(u64 host_time) { if (!input_time) input_time = host_time; }
+
 private:
+  // The render worker, a copy of parent's registers, VRAM and OAM that draws in its pixel format
+  // straight into output. It has no frames of its own and doesn't go through the setup above
+  Ppu(const Ppu& parent, TripleBuffer& output);
+
   bool oam_lock = false;
   bool vram_lock = false;
   bool latch = false;
@@ -136,24 +221,70 @@ private:
     STAT stat;
   } io;
 
+  PixelFormat pixel_format = PixelFormat::RGBA;
+  u8* pixels = nullptr;
   u8 window_internal_counter = 0;
+  u32 render_interval = 1;
+  std::atomic<bool> frame_requested = false;
+  bool render_frame = true;
+  bool drop_frames = false;
   u32 fbIndex = 0;
+  LineCallback on_line;
+  // Read by the game but not drawn yet, and what the frame being drawn gets tagged with
+  u64 input_time = 0;
+  u64 frame_input_time = 0;
 
-  u8 colorIDbg[FBSIZE]{0};
+  // The line being drawn, shifted right by 8 so sprites hanging off the left edge need no clipping.
+  // line holds palette applied shades, bg_mask the pixels with a non-zero BG color ID and obj_mask
+  // the pixels already claimed by a higher priority sprite, one bit per pixel with the MSB leftmost
+  static constexpr int LINE_SZ = WIDTH + 16;
+  u8 line[LINE_SZ]{0};
+  u8 bg_mask[LINE_SZ / 8]{0};
+  u8 obj_mask[LINE_SZ / 8]{0};
 
   u64 curr_cycles = 0;
   
   std::array<Sprite, 10> sprites;
   u8 count = 0;
 
+  // OAM indices of the sprites on each line, highest priority first.
+  // Lines are rebuilt lazily, only after an OAM write or obj_size change touched them.
+  std::array<std::array<u8, 10>, HEIGHT> line_sprites{};
+  std::array<u8, HEIGHT> line_sprite_count{};
+  std::bitset<HEIGHT> dirty_lines;
+
   void WriteIO(Mem& mem, u16 addr, u8 val, u8& intf);
   u8 ReadIO(u16 addr);
 
+  void WriteVRAM(u16 addr, u8 val);
+  void WriteOAM(u16 addr, u8 val);
+  void InvalidateSprite(u8 oam_y);
+  void BuildSpriteLine(u8 ly);
+
   void ChangeMode(u64 time, Scheduler& scheduler, Mode m, u8& intf);
   void FetchSprites();
   void RenderSprites();
   void RenderBGs();
+  void WriteLine();
+  void ClearFrame();
+  void PublishFrame(u64 tag = 0);
   void Scanline();
+  void RenderLine();
+  void DrawLine();
+  void LineDone(u8 ly);
+  void StartFrame();
   void CompareLYC(u8& intf);
+
+  // Where frames are drawn, the worker draws into the emu thread Ppu's frames
+  TripleBuffer* output = &frames;
+  void Log(const PpuLogEntry& entry);
+  void Replay(const PpuLogEntry& entry);
+  void ReplayLoop();
+  std::unique_ptr<Ppu> worker;
+  std::unique_ptr<RingBuffer<PpuLogEntry>> log;
+  std::atomic<bool> worker_running = false;
+  std::mutex worker_mutex;
+  std::condition_variable worker_cv;
+  std::thread worker_thread;
 };
 }  // namespace natsukashii::core
\ No newline at end of file
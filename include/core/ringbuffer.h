@@ -0,0 +1,67 @@
+#pragma once
+#include "util.h"
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+namespace natsukashii::core
+{
+// Lock-free single producer/single consumer ring. One thread may Push, one other thread may Pop,
+// neither ever blocks: Push drops what doesn't fit and Pop returns however much was available
+template <typename T>
+class RingBuffer
+{
+public:
+  // Capacity is rounded up to a power of two
+  explicit RingBuffer(size_t capacity) {
+    size_t size = 1;
+    while(size < capacity) size <<= 1;
+    buffer.resize(size);
+    mask = size - 1;
+  }
+
+  size_t Push(const T* data, size_t count) {
+    size_t w = write.load(std::memory_order_relaxed);
+    size_t r = read.load(std::memory_order_acquire);
+    count = std::min(count, buffer.size() - (w - r));
+    for(size_t i = 0; i < count; i++) {
+      buffer[(w + i) & mask] = data[i];
+    }
+
+    write.store(w + count, std::memory_order_release);
+    return count;
+  }
+
+  size_t Pop(T* data, size_t count) {
+    size_t r = read.load(std::memory_order_relaxed);
+    size_t w = write.load(std::memory_order_acquire);
+    count = std::min(count, w - r);
+    for(size_t i = 0; i < count; i++) {
+      data[i] = buffer[(r + i) & mask];
+    }
+
+    read.store(r + count, std::memory_order_release);
+    return count;
+  }
+
+  // Only exact when called from the producer or consumer thread, a hint otherwise
+  size_t Size() const {
+    return write.load(std::memory_order_acquire) - read.load(std::memory_order_acquire);
+  }
+
+  size_t Capacity() const { return buffer.size(); }
+
+  // Not thread safe, only while neither side is running
+  void Clear() {
+    write = 0;
+    read = 0;
+  }
+
+private:
+  std::vector<T> buffer;
+  size_t mask = 0;
+  // Free-running positions, kept on separate cache lines so both threads don't fight over one
+  alignas(64) std::atomic<size_t> write = 0;
+  alignas(64) std::atomic<size_t> read = 0;
+};
+} // natsukashii::core
@@ -0,0 +1,87 @@
+#pragma once
+#include "util.h"
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+namespace natsukashii::core
+{
+// Savestates are a flat buffer in host byte order: a header, then every component in a fixed order.
+// Plain structs go in as they are laid out in memory, so any change to what a component writes or to
+// one of those structs has to bump the version, states from other versions are refused
+constexpr u32 SAVESTATE_MAGIC = 0x4b53544e; // "NTSK"
+constexpr u32 SAVESTATE_VERSION = 1;
+
+struct StateHeader
+{
+  u32 magic = SAVESTATE_MAGIC;
+  u32 version = SAVESTATE_VERSION;
+  // Of the whole state, header included
+  u32 size = 0;
+  u16 rom_checksum = 0;
+};
+
+// Appends to a buffer the caller keeps around, after the first state it never allocates again
+class StateWriter
+{
+public:
+  explicit StateWriter(std::vector<u8>& out) : out(out) { out.clear(); }
+
+  void Write(const void* data, size_t size) {
+    if(!size) {
+      return;
+    }
+
+    size_t pos = out.size();
+    out.resize(pos + size);
+    memcpy(&out[pos], data, size);
+  }
+
+  template <typename T>
+  void Write(const T& value) {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain data goes into a savestate");
+    Write(&value, sizeof(T));
+  }
+
+private:
+  std::vector<u8>& out;
+};
+
+// Reads back what a StateWriter wrote. Running past the end leaves the target untouched and
+// makes Ok() false for good, callers check once at the end
+class StateReader
+{
+public:
+  StateReader(const u8* data, size_t size) : data(data), size(size) { }
+
+  void Read(void* dst, size_t count) {
+    if(!count) {
+      return;
+    }
+
+    if(!ok || count > size - pos) {
+      ok = false;
+      return;
+    }
+
+    memcpy(dst, data + pos, count);
+    pos += count;
+  }
+
+  template <typename T>
+  void Read(T& value) {
+    static_assert(std::is_trivially_copyable_v<T>, "Only plain data goes into a savestate");
+    Read(&value, sizeof(T));
+  }
+
+  bool Ok() const { return ok; }
+  // Whether everything was consumed, a state with bytes left over came from a different layout
+  bool AtEnd() const { return pos == size; }
+
+private:
+  const u8* data;
+  size_t size;
+  size_t pos = 0;
+  bool ok = true;
+};
+} // natsukashii::core
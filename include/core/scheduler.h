@@ -1,6 +1,7 @@
 #pragma once
 
-#include "common.h"
+#include "util.h"
+#include <array>
 
 #define ENTRIES_MAX 32
 
@@ -10,6 +11,7 @@ enum class Event {
   APU,
   PPU,
   Timers,
+  Joypad,
   Panic,
 };
 
@@ -28,5 +30,6 @@ struct Scheduler {
 
   void push(Entry entry);
   void pop(int count);
+  void reset();
 };
 } // natsukashii::core
\ No newline at end of file
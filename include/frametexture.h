@@ -0,0 +1,54 @@
+#pragma once
+#include "common.h"
+#include <ppu.h>
+
+namespace natsukashii::frontend
+{
+using namespace natsukashii::core;
+
+// The emulator picture as a GL texture. Frames are streamed through a ring of pixel buffer objects so
+// glTexSubImage2D never reads client memory: the copy into the PBO is a plain memcpy and the driver
+// uploads from it asynchronously. With GL_ARB_buffer_storage the PBOs stay persistently mapped and
+// fences keep us from overwriting one the GPU still reads, otherwise each upload orphans and remaps.
+// Shade8 frames are uploaded as a single channel texture, a quarter of the RGBA bytes, and turned into
+// colors by a fragment shader drawing into the displayed texture, with the palette as a uniform
+struct FrameTexture
+{
+  ~FrameTexture();
+  // RGBA or Shade8
+  void Init(PixelFormat format, const u8* initial);
+  // Only call when there is a new frame
+  void Upload(const u8* frame);
+  // Beam racing, count rows starting at line first. Straight from client memory, a band is small and
+  // gets drawn right away, a PBO wouldn't buy any overlap
+  void UploadRows(int first, int count, const u8* rows);
+  // Shade8 only, 0xRRGGBBAA like colors[]. Redraws the current frame, no new upload needed
+  void SetPalette(const u32 palette[4]);
+  // Needs the GL context, so before the window goes away
+  void Destroy();
+
+  // What gets displayed, RGBA either way
+  unsigned int id = 0;
+private:
+  static constexpr int PBO_COUNT = 3;
+
+  void InitPalettePass();
+  void Convert();
+
+  PixelFormat format = PixelFormat::RGBA;
+  size_t size = 0;
+  bool persistent = false;
+  int next = 0;
+  unsigned int pbos[PBO_COUNT]{};
+  u8* mapped[PBO_COUNT]{};
+  GLsync fences[PBO_COUNT]{};
+
+  // Shade8: the uploaded shades and the pass that colors them into id
+  unsigned int shades = 0;
+  unsigned int fbo = 0;
+  unsigned int vao = 0;
+  unsigned int program = 0;
+  int palette_location = -1;
+  float palette[4][4]{};
+};
+} // natsukashii::frontend
@@ -1,5 +1,8 @@
 #pragma once
 #include "core.h"
+#include "frametexture.h"
+#include "scanout.h"
+#include "sdlsink.h"
 #include <nfd.hpp>
 #include <thread>
 
@@ -8,6 +11,22 @@ namespace natsukashii::frontend
 using namespace natsukashii::core;
 
 constexpr float aspect_ratio_gb = (float)WIDTH / (float)HEIGHT;
+
+// Input-to-photon latency of the last SAMPLES inputs that reached the screen: from key_callback
+// to the glfwSwapBuffers of the first frame drawn after the game read the new joypad state
+struct LatencyHistogram
+{
+  static constexpr int SAMPLES = 128;
+  static constexpr int BINS = 25;
+  static constexpr float BIN_MS = 4;
+
+  void Add(float ms);
+  void Draw();
+
+  std::array<float, SAMPLES> samples{};
+  int count = 0;
+  int next = 0;
+};
 struct MainWindow
 {
   MainWindow(std::string title);
@@ -18,15 +37,20 @@ struct MainWindow
   void MenuBar();
 
   std::thread emu_thread;
-  void PingEmuThread();
-  void WaitEmuThread();
 
   bool running = true;
   mINI::INIFile file;
   mINI::INIStructure ini;
   GLFWwindow* window = nullptr;
   std::unique_ptr<Core> core;
-  int key;
-  unsigned int id;
+  FrameTexture texture;
+  // Only with video.beam_racing, frames then arrive band by band
+  std::unique_ptr<ScanoutBands> bands;
+  ScanoutBands::Band band;
+  // Set by the emu thread right before it wakes Run, tells its wake-ups apart from input
+  std::atomic<bool> emu_woke = false;
+  LatencyHistogram latency;
+  // Tag of the frame uploaded since the last swap, measured once the swap went out
+  u64 presented_input = 0;
 };
 } // natsukashii::frontend
\ No newline at end of file
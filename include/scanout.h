@@ -0,0 +1,41 @@
+#pragma once
+#include "common.h"
+#include <ppu.h>
+#include <ringbuffer.h>
+#include <array>
+#include <functional>
+
+namespace natsukashii::frontend
+{
+using namespace natsukashii::core;
+
+// Beam racing: gathers the scanlines the Ppu passes to its line callback into bands and queues every
+// finished band to the UI thread, which uploads and presents it while the rest of the frame is still
+// being drawn. The top of the screen shows up most of a frame earlier than through the triple buffer
+struct ScanoutBands
+{
+  static constexpr int BAND_LINES = 36;
+
+  struct Band
+  {
+    u8 first = 0;
+    u8 count = 0;
+    std::array<u8, BAND_LINES * WIDTH * sizeof(u32)> rows;
+  };
+
+  // RGBA or Shade8, whatever the Ppu draws
+  explicit ScanoutBands(PixelFormat format);
+  // Drawing thread, hand this to Ppu::SetLineCallback
+  void Line(u8 ly, const u8* row);
+  // UI thread, false once nothing is queued
+  bool Pop(Band& band);
+
+  // Called on the drawing thread after a band was queued
+  std::function<void()> on_band;
+private:
+  size_t row_size;
+  Band staging;
+  // A frame and then some. If the UI falls further behind the band is dropped, the next frame repaints it
+  RingBuffer<Band> ready{8};
+};
+} // natsukashii::frontend
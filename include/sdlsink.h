@@ -0,0 +1,34 @@
+#pragma once
+#include <apu.h>
+#define SDL_MAIN_HANDLED
+#include <SDL2/SDL.h>
+
+namespace natsukashii::frontend
+{
+using namespace natsukashii::core;
+
+// Opens the backend named in the ini ("sdl", "null" or "wav"), falls back to NullSink instead of
+// taking the emulator down when there is no usable audio device
+std::unique_ptr<AudioSink> OpenAudioSink(const std::string& backend, const std::string& wav_path);
+
+// The sound card, fed through a lock-free ring drained by SDL's pull callback
+class SdlSink : public AudioSink
+{
+public:
+  // nullptr if no device could be opened
+  static std::unique_ptr<SdlSink> Open();
+  ~SdlSink() override;
+  int SampleRate() const override { return sample_rate; }
+  void Push(const float* samples, size_t frames) override;
+  u32 Queued() override;
+  u32 Underruns() const override { return underruns; }
+private:
+  SdlSink() = default;
+  static void Callback(void* userdata, Uint8* stream, int len);
+  SDL_AudioDeviceID device = 0;
+  int sample_rate = FREQUENCY;
+  RingBuffer<float> ring{AUDIO_TARGET * CHANNELS * 4};
+  std::atomic<u32> underruns = 0;
+  float last_sample[CHANNELS]{};
+};
+} // natsukashii::frontend
\ No newline at end of file
@@ -1,88 +1,396 @@
 #include <core.h>
+#include <algorithm>
 #include <chrono>
+#include <filesystem>
+#include <thread>
 #include <utility>
 
 using clk = std::chrono::high_resolution_clock;
 
 namespace natsukashii::core
 {
-Core::Core(bool skip, std::string bootrom_path) : bus(skip, std::move(bootrom_path)), cpu(skip, &bus) {}
+Core::Core(bool skip, std::string bootrom_path) : bus(skip, std::move(bootrom_path)), cpu(skip, &bus) {
+  ResetScheduler();
+}
+
+void Core::RunFrame() {
+  frame_cycles = cycles;
+  PollInputs();
+  u64 frame_end = cycles + CYCLES_PER_FRAME;
+  while(cycles < frame_end) {
+    while(cycles < scheduler.entries[0].time && cycles < frame_end) {
+      u64 start = cycles;
+      cycles += cpu.Step();
+      cpu.HandleInterrupts(cycles);
+      bus.apu.Step(cycles - start);
+    }
 
-void Core::Run() {
-  while(cycles < scheduler.entries[0].time) {
-    cycles += cpu.Step();
-    cpu.HandleInterrupts(cycles);
-    bus.mem.DoInputs(key);
+    DispatchEvents();
   }
 }
 
 void Core::DispatchEvents() {
-  int last_pos = 0;
-  for(int i = 0; i < scheduler.pos; i++) {
-    if(scheduler.entries[i].time > cycles) {
-      last_pos = i;
-      break;
-    }
+  // Handlers push new entries, so take one due entry off the front at a time
+  while(scheduler.entries[0].time <= cycles) {
+    Entry entry = scheduler.entries[0];
+    scheduler.pop(1);
 
-    switch(scheduler.entries[0].event) {
-    case Event::None: case Event::APU:
+    switch(entry.event) {
+    case Event::None:
+      break;
+    case Event::APU:
+      bus.apu.DispatchEvents(entry.time, cycles, scheduler);
       break;
     case Event::Timers:
-      cpu.DispatchTimers(scheduler.entries[i].time, scheduler);
+      cpu.DispatchTimers(entry.time, scheduler);
       break;
     case Event::PPU:
-      bus.ppu.DispatchEvents(scheduler.entries[i].time, scheduler, bus.mem.io.intf);
+      bus.ppu.DispatchEvents(entry.time, scheduler, bus.mem.io.intf);
+      break;
+    case Event::Joypad:
+      DispatchInputs(entry.time);
       break;
     case Event::Panic:
       printf("Panic event! Achievement unlocked: \"How did we get here?\"\n");
       exit(1);
     }
   }
+}
+
+void Core::ResetScheduler() {
+  scheduler.reset();
+  joypad_scheduled = false;
+  scheduler.push(Entry(cycles + 80, Event::PPU));
+  scheduler.push(Entry(cycles + 8192, Event::APU));
+}
+
+void Core::PressButton(u8 button, bool pressed, u64 host_time) {
+  QueueInput({frame_cycles, button, pressed, host_time});
+}
+
+void Core::QueueInput(const InputEvent& event) {
+  // Only drops when the emu thread is paused and hundreds of events piled up
+  inputs.Push(&event, 1);
+}
+
+void Core::PollInputs() {
+  InputEvent event;
+  while(inputs.Pop(&event, 1)) {
+    pending.push_back(event);
+  }
+
+  if(!pending.empty() && !joypad_scheduled) {
+    scheduler.push(Entry(std::max(pending.front().cycle, cycles), Event::Joypad));
+    joypad_scheduled = true;
+  }
+}
+
+void Core::DispatchInputs(u64 time) {
+  // Events arrive in order, apply everything that is due and come back for the rest
+  auto due = pending.begin();
+  for(; due != pending.end() && due->cycle <= time; due++) {
+    bus.mem.SetButton(due->button, due->pressed, due->host_time);
+  }
+  pending.erase(pending.begin(), due);
+
+  joypad_scheduled = false;
+  if(!pending.empty()) {
+    scheduler.push(Entry(pending.front().cycle, Event::Joypad));
+    joypad_scheduled = true;
+  }
+}
+
+Core::~Core() {
+  CommandRequest* request;
+  while(commands.Pop(&request, 1)) {
+    delete request;
+  }
+}
+
+std::future<void> Core::LoadROM(std::string path) {
+  return Post(Command::LoadROM, std::move(path));
+}
+
+std::future<void> Core::Reset() {
+  return Post(Command::Reset);
+}
+
+std::future<void> Core::Pause() {
+  return Post(Command::Pause);
+}
 
-  scheduler.pop(last_pos);
+std::future<void> Core::Stop() {
+  return Post(Command::Stop);
 }
 
-void Core::LoadROM(std::string path) {
-  cpu.Reset();
-  bus.Reset();
-  bus.LoadROM(std::move(path));
-  init = true;
+std::future<void> Core::SaveState(int slot) {
+  return Post(Command::SaveState, "", slot);
 }
 
-void Core::Reset() {
-  cpu.Reset();
-  bus.Reset();
+std::future<void> Core::LoadState(int slot) {
+  return Post(Command::LoadState, "", slot);
 }
 
-void Core::Pause() {
-  pause = !pause;
+std::future<void> Core::Quit() {
+  return Post(Command::Quit);
 }
 
-void Core::Stop() {
-  cpu.Reset();
-  bus.Reset();
-  init = false;
+void Core::Serialize(std::vector<u8>& out) {
+  StateWriter state(out);
+  StateHeader header;
+  header.rom_checksum = bus.mem.RomChecksum();
+  state.Write(header);
+  state.Write(cycles);
+  state.Write(scheduler.entries);
+  state.Write(scheduler.pos);
+  state.Write(joypad_scheduled);
+  u32 count = pending.size();
+  state.Write(count);
+  state.Write(pending.data(), count * sizeof(InputEvent));
+  cpu.SaveState(state);
+  bus.SaveState(state);
+
+  header.size = out.size();
+  memcpy(out.data(), &header, sizeof(header));
 }
 
-void Core::SaveState(int slot) {
-  cpu.SaveState(slot);
+bool Core::Deserialize(const u8* data, size_t size) {
+  StateHeader header;
+  if(size < sizeof(header)) {
+    return false;
+  }
+
+  memcpy(&header, data, sizeof(header));
+  if(header.magic != SAVESTATE_MAGIC || header.version != SAVESTATE_VERSION ||
+     header.size != size || header.rom_checksum != bus.mem.RomChecksum()) {
+    return false;
+  }
+
+  StateReader state(data, size);
+  state.Read(header);
+  state.Read(cycles);
+  state.Read(scheduler.entries);
+  state.Read(scheduler.pos);
+  state.Read(joypad_scheduled);
+  u32 count = 0;
+  state.Read(count);
+  pending.resize(std::min<size_t>(count, size / sizeof(InputEvent)));
+  state.Read(pending.data(), pending.size() * sizeof(InputEvent));
+  cpu.LoadState(state);
+  bus.LoadState(state);
+  frame_cycles = cycles;
+
+  if(!state.Ok() || !state.AtEnd() || count != pending.size()) {
+    // Same version and size but it doesn't parse, a half loaded machine is worse than a fresh one
+    printf("Corrupt savestate, resetting\n");
+    cpu.Reset();
+    bus.Reset();
+    ResetScheduler();
+    pending.clear();
+    return false;
+  }
+
+  return true;
 }
 
-void Core::LoadState(int slot) {
-  cpu.LoadState(slot);
+std::string Core::SlotPath(int slot) {
+  namespace fs = std::filesystem;
+  if(bus.mem.savefile.empty()) {
+    return "";
+  }
+
+  if(!fs::exists(fs::absolute("savestates"))) {
+    fs::create_directory("savestates");
+  }
+  return fs::absolute("savestates/").string() + bus.mem.savefile + std::to_string(slot);
 }
 
-[[noreturn]] void Core::RunAsync() {
+void Core::SaveSlot(int slot) {
+  std::string path = SlotPath(slot);
+  if(path.empty()) {
+    return;
+  }
+
+  Serialize(slot_buffer);
+  std::ofstream file{path, std::ios::binary};
+  file.write((char*)slot_buffer.data(), slot_buffer.size());
+}
+
+void Core::LoadSlot(int slot) {
+  std::string path = SlotPath(slot);
+  if(path.empty()) {
+    return;
+  }
+
+  std::ifstream file{path, std::ios::binary | std::ios::ate};
+  if(!file.is_open()) {
+    printf("Nothing saved in slot %d\n", slot);
+    return;
+  }
+
+  slot_buffer.resize(file.tellg());
+  file.seekg(0);
+  file.read((char*)slot_buffer.data(), slot_buffer.size());
+  if(!Deserialize(slot_buffer.data(), slot_buffer.size())) {
+    printf("Savestate in slot %d is from another version or game\n", slot);
+  }
+}
+
+std::future<void> Core::Post(Command command, std::string path, int slot) {
+  auto* request = new CommandRequest{command, std::move(path), slot};
+  std::future<void> done = request->done.get_future();
+  // Only full if the UI posted dozens of commands within a single frame
+  while(!commands.Push(&request, 1)) {
+    std::this_thread::yield();
+  }
+  Wake();
+  return done;
+}
+
+void Core::ExecuteCommands() {
+  CommandRequest* request;
+  bool executed = false;
+  while(commands.Pop(&request, 1)) {
+    Execute(*request);
+    request->done.set_value();
+    delete request;
+    executed = true;
+  }
+
+  if(executed && on_command) {
+    on_command();
+  }
+}
+
+void Core::Execute(CommandRequest& request) {
+  switch(request.command) {
+  case Command::Pause:
+    pause = !pause;
+    break;
+  case Command::Reset:
+    cpu.Reset();
+    bus.Reset();
+    ResetScheduler();
+    break;
+  case Command::Quit:
+    quit = true;
+    [[fallthrough]];
+  case Command::Stop:
+    cpu.Reset();
+    bus.Reset();
+    ResetScheduler();
+    init = false;
+    break;
+  case Command::LoadROM:
+    cpu.Reset();
+    bus.Reset();
+    ResetScheduler();
+    bus.LoadROM(std::move(request.path));
+    init = true;
+    break;
+  case Command::SaveState:
+    SaveSlot(request.slot);
+    break;
+  case Command::LoadState:
+    LoadSlot(request.slot);
+    break;
+  }
+}
+
+void Core::RunAsync() {
+  auto last_frame = clk::now();
   while (true) {
-    WaitPing();
-    Run();
-    run_emu_thread = false;
+    WaitRunnable();
+    ExecuteCommands();
+    if(quit) {
+      return;
+    }
+
+    if(!init || pause) {
+      continue;
+    }
+
+    bool turbo = Turbo();
+    bus.ppu.SetRenderInterval(turbo ? 0 : 1);
+    auto start = clk::now();
+    RunFrame();
+
+    if(turbo) {
+      AudioSink& sink = bus.apu.Output();
+      bool output = !sink.Realtime() || (!turbo_mute && sink.Queued() < AUDIO_TARGET);
+      bus.apu.resample_ratio = 1.0;
+      bus.apu.EndFrame(output);
+      bus.ppu.SetDropFrames(false);
+    } else {
+      bus.apu.EndFrame();
+      float work_ms = std::chrono::duration<float, std::milli>(clk::now() - start).count();
+      PaceToAudio();
+      Watchdog(work_ms);
+    }
+
+    auto now = clk::now();
+    float interval_ms = std::chrono::duration<float, std::milli>(now - last_frame).count();
+    float error_ms = interval_ms - FRAME_PERIOD_NS / 1e6f;
+    stats.error_ms = stats.error_ms * 0.95f + error_ms * 0.05f;
+    stats.speed = stats.speed * 0.9f + (FRAME_PERIOD_NS / 1e6f) / std::max(interval_ms, 0.01f) * 0.1f;
+    last_frame = now;
   }
 }
 
-void Core::WaitPing() {
+void Core::PaceToAudio() {
+  AudioSink& sink = bus.apu.Output();
+  stats.underruns = sink.Underruns();
+  // Offline sinks take samples as fast as they come, nothing to pace to
+  if(!sink.Realtime()) {
+    bus.apu.resample_ratio = 1.0;
+    stats.buffer_ms = 0;
+    stats.ratio = 1;
+    return;
+  }
+
+  // The device consumes samples at exactly its own rate, so it is the clock: run ahead until
+  // AUDIO_TARGET frames are queued, then sleep for however long it takes to drain the excess
+  u32 queued = sink.Queued();
+  while(queued > AUDIO_TARGET) {
+    std::this_thread::sleep_for(std::chrono::microseconds(u64(queued - AUDIO_TARGET) * 1000000 / bus.apu.sample_rate));
+    queued = sink.Queued();
+  }
+
+  // Blocking alone gives a sawtooth fill level, so also bend the sample rate by up to 0.5%
+  // towards the target. Below target more samples are produced per frame and vice versa
+  double error = (double(AUDIO_TARGET) - queued) / AUDIO_TARGET;
+  bus.apu.resample_ratio = 1.0 + std::clamp(error, -1.0, 1.0) * 0.005;
+
+  stats.buffer_ms = queued * 1000.f / bus.apu.sample_rate;
+  stats.ratio = bus.apu.resample_ratio;
+}
+
+// Frames skipped in a row before one is drawn anyway, so the picture never freezes completely
+constexpr u32 MAX_DROPS = 4;
+
+void Core::Watchdog(float work_ms) {
+  stats.work_ms = stats.work_ms * 0.9f + work_ms * 0.1f;
+
+  // Behind when the audio queue the pacer keeps at AUDIO_TARGET is running dry,
+  // or when frames on average take longer to emulate than they last
+  AudioSink& sink = bus.apu.Output();
+  bool behind = sink.Realtime() && sink.Queued() < AUDIO_TARGET / 2;
+  behind |= stats.work_ms > FRAME_PERIOD_NS / 1e6f;
+
+  bool drop = behind && dropped_in_a_row < MAX_DROPS;
+  dropped_in_a_row = drop ? dropped_in_a_row + 1 : 0;
+  bus.ppu.SetDropFrames(drop);
+  stats.skipped = bus.ppu.frames_dropped;
+}
+
+void Core::WaitRunnable() {
   std::unique_lock <std::mutex> lock (emu_mutex);
-  emu_condition_variable.wait(lock, [&]{ return run_emu_thread == true; });
+  emu_condition_variable.wait(lock, [&]{ return (init && !pause) || commands.Size() != 0; });
+}
+
+void Core::Wake() {
+  std::lock_guard <std::mutex> lock (emu_mutex);
+  emu_condition_variable.notify_one();
 }
 
 }  // namespace natsukashii::core
\ No newline at end of file
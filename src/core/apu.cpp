@@ -2,39 +2,156 @@
 
 namespace natsukashii::core
 {
+// Amplitudes reach 15 * 8 per channel with the master volume at max
+constexpr float MIX_SCALE = 1.f / (4 * 15 * 8);
+
+Apu::Apu(bool skip) : skip(skip)
+{
+	memset(buffer, 0, sizeof(buffer));
+	for(auto& output : outputs) {
+		output.left = &left;
+		output.right = &right;
+	}
+	// Before any register write, the rate decides how big the buffers are
+	left.set_rates(4194304, sample_rate * resample_ratio);
+	right.set_rates(4194304, sample_rate * resample_ratio);
+	PowerOnDefaults();
+}
+
 Apu::~Apu() {
-	SDL_CloseAudioDevice(device);
+	SetOffload(false);
 }
 
-void audio_callback(void* userdata, Uint8* buffer, int len) {
-  if(((Apu*)userdata)->buffer_pos >= SAMPLES * 2) {
-    ((Apu*)userdata)->buffer_pos = 0;
-    u32 len = SAMPLES * CHANNELS * sizeof(float);
-    while(SDL_GetQueuedAudioSize(((Apu*)userdata)->device) > len * 4) {	}
-    SDL_QueueAudio(((Apu*)userdata)->device, buffer, len);
-  }
+void Apu::SetSink(std::unique_ptr<AudioSink> new_sink) {
+	sink = std::move(new_sink);
+	sample_rate = sink->SampleRate();
+	left.set_rates(4194304, sample_rate * resample_ratio);
+	right.set_rates(4194304, sample_rate * resample_ratio);
 }
 
-Apu::Apu(bool skip) : skip(skip)
-{
-	SDL_Init(SDL_INIT_AUDIO);
-	memset(buffer, 0, SAMPLES * 2);
-	SDL_AudioSpec want = {
-		.freq = FREQUENCY,
-		.format = AUDIO_F32SYS,
-		.channels = CHANNELS,
-		.samples = SAMPLES,
-		.callback = audio_callback,
-		.userdata = this,
-	}, have;
-
-	device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
-	if (device == 0) {
-		printf("Failed to open audio device: %s\n", SDL_GetError());
-		exit(1);
-	}
-	
-	SDL_PauseAudioDevice(device, 0);
+void Apu::SetOffload(bool enable) {
+	if(enable == (worker != nullptr)) {
+		return;
+	}
+
+	if(enable) {
+		// The worker starts out as an exact copy of what the registers currently say
+		worker = std::make_unique<Apu>(skip);
+		worker->SetSink(std::move(sink));
+		worker->ch1 = ch1;
+		worker->ch2 = ch2;
+		worker->ch3 = ch3;
+		worker->ch4 = ch4;
+		worker->left_enable = left_enable;
+		worker->right_enable = right_enable;
+		worker->left_volume = left_volume;
+		worker->right_volume = right_volume;
+		worker->nr51 = nr51;
+		worker->apu_enabled = apu_enabled;
+		worker->frame_sequencer_position = frame_sequencer_position;
+		worker->frame_time = worker->last_time = frame_time;
+		worker->UpdateGains();
+		// Far more than the writes of the few frames the pacer lets the emu thread run ahead
+		log = std::make_unique<RingBuffer<ApuLogEntry>>(1 << 16);
+		worker_running = true;
+		worker_thread = std::thread([this] { ReplayLoop(); });
+	} else {
+		worker_running = false;
+		worker_cv.notify_one();
+		worker_thread.join();
+		SetSink(std::move(worker->sink));
+		worker.reset();
+		log.reset();
+		last_time = frame_time;
+		UpdateGains();
+	}
+}
+
+AudioSink& Apu::Output() {
+	return worker ? *worker->sink : *sink;
+}
+
+void Apu::SaveState(StateWriter& state) {
+	state.Write(ch1);
+	state.Write(ch2);
+	state.Write(ch3);
+	state.Write(ch4);
+	state.Write(left_enable);
+	state.Write(right_enable);
+	state.Write(left_volume);
+	state.Write(right_volume);
+	state.Write(nr51);
+	state.Write(frame_sequencer_position);
+	state.Write(apu_enabled);
+}
+
+void Apu::LoadState(StateReader& state) {
+	// The worker has to start over from the loaded channels, the same way it starts from the registers
+	bool offloaded = worker != nullptr;
+	SetOffload(false);
+	state.Read(ch1);
+	state.Read(ch2);
+	state.Read(ch3);
+	state.Read(ch4);
+	state.Read(left_enable);
+	state.Read(right_enable);
+	state.Read(left_volume);
+	state.Read(right_volume);
+	state.Read(nr51);
+	state.Read(frame_sequencer_position);
+	state.Read(apu_enabled);
+	UpdateGains();
+	SetOffload(offloaded);
+}
+
+void Apu::Log(ApuLogEntry entry) {
+	// Only full if the worker stalled for a long time, dropping a write would leave a channel wrong
+	while(!log->Push(&entry, 1)) {
+		std::this_thread::yield();
+	}
+}
+
+// Worker thread. Woken once per frame, a missed notify only costs the wait timeout
+void Apu::ReplayLoop() {
+	ApuLogEntry entries[256];
+	while(true) {
+		size_t count = log->Pop(entries, 256);
+		for(size_t i = 0; i < count; i++) {
+			worker->Replay(entries[i]);
+		}
+
+		if(count) {
+			continue;
+		}
+
+		if(!worker_running) {
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(worker_mutex);
+		worker_cv.wait_for(lock, std::chrono::milliseconds(5));
+	}
+}
+
+void Apu::Replay(const ApuLogEntry& entry) {
+	switch(entry.kind) {
+		case ApuLogKind::Write:
+			frame_time = entry.time;
+			WriteIO(0xff00 | entry.reg, entry.value);
+			break;
+		case ApuLogKind::Sequencer:
+			RunUntil(entry.time);
+			StepFrameSequencer();
+			break;
+		case ApuLogKind::EndFrame:
+			frame_time = entry.time;
+			resample_ratio = entry.ratio;
+			EndFrame(entry.value);
+			break;
+		case ApuLogKind::Reset:
+			Reset();
+			break;
+	}
 }
 
 void Apu::Reset()
@@ -43,27 +160,42 @@ void Apu::Reset()
 	ch1.reset();
 	ch2.reset();
 	ch3.reset();
-	memset(buffer, 0, SAMPLES * 2);
-	SDL_CloseAudioDevice(device);
-	SDL_AudioSpec want = {
-		.freq = FREQUENCY,
-		.format = AUDIO_F32SYS,
-		.channels = CHANNELS,
-		.samples = SAMPLES,
-		.callback = audio_callback,
-		.userdata = this,
-	}, have;
-
-	device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, 0);
-	if (device == 0) {
-		printf("Failed to open audio device: %s\n", SDL_GetError());
-		exit(1);
-	}
-  
-	SDL_PauseAudioDevice(device, 0);
+	ch4.reset();
+	memset(buffer, 0, sizeof(buffer));
+	frame_time = 0;
+	last_time = 0;
+	left.clear();
+	right.clear();
+	for(auto& output : outputs) {
+		output.amp = 0;
+		output.gain_left = output.gain_right = 0;
+	}
+	PowerOnDefaults();
+	if(worker) {
+		Log({0, ApuLogKind::Reset, 0, 0, 0});
+	}
+}
+
+void Apu::PowerOnDefaults() {
+	// Without the bootrom nobody sets up NR50-NR52, start out with what it leaves behind
+	apu_enabled = skip;
+	nr51 = skip ? 0xf3 : 0;
+	left_volume = right_volume = skip ? 7 : 0;
+	UpdateGains();
 }
 
 void Apu::WriteIO(u16 addr, u8 value) {
+	if(worker) {
+		Log({frame_time, ApuLogKind::Write, u8(addr), value, 0});
+	} else {
+		// Everything up to now still sounds the way the registers were
+		RunUntil(frame_time);
+	}
+
+	WriteRegister(addr, value);
+}
+
+void Apu::WriteRegister(u16 addr, u8 value) {
 	switch(addr & 0xff) {
     case 0x10 ... 0x14: ch1.write(addr, value); break;
     case 0x16 ... 0x19: ch2.write(addr, value); break;
@@ -76,13 +208,17 @@ void Apu::WriteIO(u16 addr, u8 value) {
 			right_volume = value & 7;
 			left_enable = value & 0x80;
 			right_enable = value & 8;
+			UpdateGains();
+			break;
+		case 0x25:
+			nr51 = value;
+			UpdateGains();
 			break;
-		case 0x25: nr51 = value; break;
 		case 0x26: {
 			bool enable = value >> 7;
 			if(!enable && apu_enabled) {
 				for(u16 i = 0xff10; i <= 0xff25; i++) {
-					WriteIO(i, 0);
+					WriteRegister(i, 0);
 				}
 
 				apu_enabled = false;
@@ -110,56 +246,115 @@ u8 Apu::ReadIO(u16 addr) {
 		case 0x25:
 			return nr51;
 		case 0x26:
-			return (((u8)apu_enabled << 7) & 0x70) | (u8)ch1.nr14.enabled | ((u8)ch2.nr24.enabled << 1) | ((u8)ch3.nr34.enabled << 2) | ((u8)ch4.nr44.enabled << 3);
+			return ((u8)apu_enabled << 7) | 0x70 | (u8)ch1.nr14.enabled | ((u8)ch2.nr24.enabled << 1) | ((u8)ch3.nr34.enabled << 2) | ((u8)ch4.nr44.enabled << 3);
   }
 }
 
 void Apu::Step(u8 cycles) {
-	for(int i = 0; i < cycles; i++) {
-		sample_clock++;
-		ch1.tick();
-		ch2.tick();
-		//ch3.tick();
-
-		if((sample_clock % 8192) == 0) {
-			sample_clock = 0;
-			switch(frame_sequencer_position) {
-				case 0:
-				ch1.step_length();
-				ch2.step_length();
-				ch3.step_length();
-				break;
-				case 1: case 3: case 5: break;
-				case 2:
-				ch1.step_length();	
-				ch2.step_length();
-				ch3.step_length();
-				ch1.step_sweep();
-				break;
-				case 4:
-				ch1.step_length();
-				ch2.step_length();
-				ch3.step_length();
-				break;
-				case 6:
-				ch1.step_length();
-				ch2.step_length();
-				ch3.step_length();
-				ch1.step_sweep();
-				break;
-				case 7:
-				ch1.step_volume();
-				ch2.step_volume();
-				break;
-			}
+	frame_time += cycles;
+}
 
-			frame_sequencer_position = (frame_sequencer_position + 1) & 7;
-		}
-		
-		if((sample_clock % (4194304 / FREQUENCY)) == 0) {
-			buffer[buffer_pos++] = (left_volume / 7) * ((float)((ch1.sample() + ch2.sample() /*+ ch3.sample()*/)) / 8);
-			buffer[buffer_pos++] = (right_volume / 7) * ((float)((ch1.sample() + ch2.sample() /*+ ch3.sample()*/)) / 8);
+void Apu::DispatchEvents(u64 time, u64 now, Scheduler& scheduler) {
+	u32 tick = frame_time - u32(now - time);
+	if(worker) {
+		Log({tick, ApuLogKind::Sequencer, 0, 0, 0});
+	} else {
+		// Whatever the channels did up to the tick still uses the old length/volume/sweep state
+		RunUntil(tick);
+	}
+	StepFrameSequencer();
+	scheduler.push(Entry(time + 8192, Event::APU));
+}
+
+void Apu::RunUntil(u32 time) {
+	if(time <= last_time) {
+		return;
+	}
+
+	ch1.run(last_time, time, outputs[0]);
+	ch2.run(last_time, time, outputs[1]);
+	ch3.run(last_time, time, outputs[2]);
+	ch4.run(last_time, time, outputs[3]);
+	last_time = time;
+}
+
+void Apu::UpdateGains() {
+	if(worker) {
+		return;
+	}
+
+	for(int i = 0; i < 4; i++) {
+		int gain_left = bit<u8>(nr51, i + 4) ? left_volume + 1 : 0;
+		int gain_right = bit<u8>(nr51, i) ? right_volume + 1 : 0;
+		outputs[i].set_gains(last_time, gain_left, gain_right);
+	}
+}
+
+void Apu::StepFrameSequencer() {
+	switch(frame_sequencer_position) {
+		case 0:
+		ch1.step_length();
+		ch2.step_length();
+		ch3.step_length();
+		ch4.step_length();
+		break;
+		case 1: case 3: case 5: break;
+		case 2:
+		ch1.step_length();	
+		ch2.step_length();
+		ch3.step_length();
+		ch4.step_length();
+		ch1.step_sweep();
+		break;
+		case 4:
+		ch1.step_length();
+		ch2.step_length();
+		ch3.step_length();
+		ch4.step_length();
+		break;
+		case 6:
+		ch1.step_length();
+		ch2.step_length();
+		ch3.step_length();
+		ch4.step_length();
+		ch1.step_sweep();
+		break;
+		case 7:
+		ch1.step_volume();
+		ch2.step_volume();
+		ch4.step_volume();
+		break;
+	}
+
+	frame_sequencer_position = (frame_sequencer_position + 1) & 7;
+}
+
+void Apu::EndFrame(bool output) {
+	if(worker) {
+		Log({frame_time, ApuLogKind::EndFrame, 0, output, float(resample_ratio)});
+		frame_time = 0;
+		worker_cv.notify_one();
+		return;
+	}
+
+	RunUntil(frame_time);
+	left.end_frame(frame_time);
+	right.end_frame(frame_time);
+	frame_time = 0;
+	last_time = 0;
+
+	// All of it, in as many pieces as buffer needs. Whatever stayed behind would shrink the room
+	// Blip keeps for the next frame
+	while(int count = std::min(left.samples_avail(), SAMPLES * 2)) {
+		left.read_samples(&buffer[0], count, CHANNELS, MIX_SCALE);
+		right.read_samples(&buffer[1], count, CHANNELS, MIX_SCALE);
+		if(output) {
+			sink->Push(buffer, count);
 		}
 	}
+
+	// Deltas already in the buffers were placed at the old rate, so only switch between frames
+	left.set_rates(4194304, sample_rate * resample_ratio);
+	right.set_rates(4194304, sample_rate * resample_ratio);
 }
 }
\ No newline at end of file
@@ -0,0 +1,119 @@
+#include "audiosink.h"
+#include <algorithm>
+#include <string.h>
+
+namespace natsukashii::core
+{
+void NullSink::Drain() {
+  auto now = clock::now();
+  queued -= std::chrono::duration<double>(now - last).count() * FREQUENCY;
+  queued = std::max(queued, 0.0);
+  last = now;
+}
+
+void NullSink::Push(const float*, size_t frames) {
+  std::lock_guard<std::mutex> lock(mutex);
+  Drain();
+  queued += frames;
+}
+
+u32 NullSink::Queued() {
+  std::lock_guard<std::mutex> lock(mutex);
+  Drain();
+  return u32(queued);
+}
+
+std::unique_ptr<WavSink> WavSink::Open(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if(!file) {
+    return nullptr;
+  }
+
+  return std::unique_ptr<WavSink>(new WavSink(file));
+}
+
+WavSink::WavSink(FILE* file) : file(file) {
+  WriteHeader(0);
+  thread = std::thread([this] { Writer(); });
+}
+
+WavSink::~WavSink() {
+  running = false;
+  cv.notify_one();
+  thread.join();
+  WriteHeader(u32(std::min<u64>(data_bytes, 0xffffffff - 36)));
+  fclose(file);
+}
+
+static void put_u16(u8* p, u16 val) {
+  p[0] = val;
+  p[1] = val >> 8;
+}
+
+static void put_u32(u8* p, u32 val) {
+  put_u16(p, val);
+  put_u16(p + 2, val >> 16);
+}
+
+// 44 byte canonical header, format 3 is IEEE float
+void WavSink::WriteHeader(u32 size) {
+  u8 header[44];
+  memcpy(&header[0], "RIFF", 4);
+  put_u32(&header[4], 36 + size);
+  memcpy(&header[8], "WAVEfmt ", 8);
+  put_u32(&header[16], 16);
+  put_u16(&header[20], 3);
+  put_u16(&header[22], CHANNELS);
+  put_u32(&header[24], FREQUENCY);
+  put_u32(&header[28], FREQUENCY * CHANNELS * sizeof(float));
+  put_u16(&header[32], CHANNELS * sizeof(float));
+  put_u16(&header[34], 32);
+  memcpy(&header[36], "data", 4);
+  put_u32(&header[40], size);
+
+  long pos = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  fwrite(header, 1, sizeof(header), file);
+  if(pos > long(sizeof(header))) {
+    fseek(file, pos, SEEK_SET);
+  }
+}
+
+// Only waits when the ring is full, which takes seconds of audio the disk didn't keep up with
+void WavSink::Push(const float* samples, size_t frames) {
+  size_t count = frames * CHANNELS;
+  while(true) {
+    size_t pushed = ring.Push(samples, count);
+    samples += pushed;
+    count -= pushed;
+    cv.notify_one();
+    if(!count) {
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    space_cv.wait_for(lock, std::chrono::milliseconds(10));
+  }
+}
+
+// Neither side notifies under the mutex, a missed notify only costs the wait timeout
+void WavSink::Writer() {
+  float chunk[4096];
+  while(true) {
+    size_t count = ring.Pop(chunk, 4096);
+    if(count) {
+      space_cv.notify_one();
+      fwrite(chunk, sizeof(float), count, file);
+      data_bytes += count * sizeof(float);
+      continue;
+    }
+
+    if(!running) {
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait_for(lock, std::chrono::milliseconds(10));
+  }
+}
+} // natsukashii::core
@@ -0,0 +1,129 @@
+#include "blip.h"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+namespace natsukashii::core
+{
+// Windowed-sinc impulse for every fractional position plus one extra phase to interpolate
+// against, each phase normalized so that integrating it gives exactly the delta back.
+// diffs holds the step to the next phase so interpolating is a single multiply-add per tap
+struct BlipKernel
+{
+  alignas(32) float taps[Blip::PHASES + 1][Blip::WIDTH];
+  alignas(32) float diffs[Blip::PHASES][Blip::WIDTH];
+
+  BlipKernel() {
+    constexpr double cutoff = 0.9;
+    constexpr double half = Blip::WIDTH / 2;
+    for(int p = 0; p <= Blip::PHASES; p++) {
+      double sum = 0;
+      for(int k = 0; k < Blip::WIDTH; k++) {
+        double x = k - (half - 1) - (double)p / Blip::PHASES;
+        double sinc = x == 0 ? 1 : std::sin(M_PI * x * cutoff) / (M_PI * x * cutoff);
+        double t = x / half;
+        double window = std::abs(t) >= 1 ? 0 : 0.42 + 0.5 * std::cos(M_PI * t) + 0.08 * std::cos(2 * M_PI * t);
+        taps[p][k] = sinc * window;
+        sum += taps[p][k];
+      }
+
+      for(int k = 0; k < Blip::WIDTH; k++) {
+        taps[p][k] /= sum;
+      }
+    }
+
+    for(int p = 0; p < Blip::PHASES; p++) {
+      for(int k = 0; k < Blip::WIDTH; k++) {
+        diffs[p][k] = taps[p + 1][k] - taps[p][k];
+      }
+    }
+  }
+};
+
+static const BlipKernel kernel;
+
+Blip::Blip(u32 max_clocks) : max_clocks(max_clocks) {}
+
+void Blip::set_rates(double clock_rate, double sample_rate) {
+  factor = u64(sample_rate / clock_rate * 4294967296.0 + 0.5);
+  leak = float(1 - std::exp(-2 * M_PI * HIGHPASS_HZ / sample_rate));
+
+  // A whole frame at this rate, the partial sample left over from the last one and the impulse tail.
+  // Only grows, so after the first few frames nothing is allocated
+  size_t size = ((max_clocks * factor) >> 32) + 2 + WIDTH;
+  if(size > buffer.size()) {
+    buffer.resize(size, 0);
+  }
+}
+
+void Blip::clear() {
+  offset = 0;
+  integrator = 0;
+  std::fill(buffer.begin(), buffer.end(), 0);
+}
+
+void Blip::add_delta(u32 time, int delta) {
+  u64 fixed = offset + time * factor;
+  size_t pos = fixed >> 32;
+  // Only a frame longer than max_clocks or samples left unread get here, both are caller bugs
+  assert(pos + WIDTH <= buffer.size());
+  if(pos + WIDTH > buffer.size()) {
+    return;
+  }
+
+  // Integer phase, a float product can round up to PHASES for fractions just below 1. Every kernel
+  // below reads diffs[p], which only has PHASES rows
+  constexpr int INTERP_BITS = 32 - PHASE_BITS;
+  int p = (fixed >> INTERP_BITS) & (PHASES - 1);
+  float interp = (fixed & ((1u << INTERP_BITS) - 1)) * (1.0f / (1u << INTERP_BITS));
+  const float* taps = kernel.taps[p];
+  const float* diffs = kernel.diffs[p];
+  float* out = &buffer[pos];
+
+#if defined(__AVX__)
+  __m256 vdelta = _mm256_set1_ps(delta), vinterp = _mm256_set1_ps(interp);
+  for(int k = 0; k < WIDTH; k += 8) {
+    __m256 tap = _mm256_add_ps(_mm256_load_ps(&taps[k]), _mm256_mul_ps(vinterp, _mm256_load_ps(&diffs[k])));
+    _mm256_storeu_ps(&out[k], _mm256_add_ps(_mm256_loadu_ps(&out[k]), _mm256_mul_ps(vdelta, tap)));
+  }
+#elif defined(__SSE2__) || defined(_M_X64)
+  __m128 vdelta = _mm_set1_ps(delta), vinterp = _mm_set1_ps(interp);
+  for(int k = 0; k < WIDTH; k += 4) {
+    __m128 tap = _mm_add_ps(_mm_load_ps(&taps[k]), _mm_mul_ps(vinterp, _mm_load_ps(&diffs[k])));
+    _mm_storeu_ps(&out[k], _mm_add_ps(_mm_loadu_ps(&out[k]), _mm_mul_ps(vdelta, tap)));
+  }
+#else
+  for(int k = 0; k < WIDTH; k++) {
+    out[k] += delta * (taps[k] + interp * diffs[k]);
+  }
+#endif
+}
+
+void Blip::end_frame(u32 time) {
+  offset += time * factor;
+}
+
+int Blip::samples_avail() const {
+  return std::min<size_t>(offset >> 32, buffer.size() - WIDTH);
+}
+
+int Blip::read_samples(float* out, int count, int stride, float scale) {
+  count = std::min(count, samples_avail());
+  for(int i = 0; i < count; i++) {
+    integrator += buffer[i];
+    out[i * stride] = integrator * scale;
+    // Leaking the integrator is a gentle high-pass, like the DC blocking capacitor on hardware
+    integrator -= integrator * leak;
+  }
+
+  std::copy(buffer.begin() + count, buffer.end(), buffer.begin());
+  std::fill(buffer.end() - count, buffer.end(), 0);
+  offset -= (u64)count << 32;
+  return count;
+}
+} // natsukashii::core
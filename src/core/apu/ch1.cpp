@@ -61,21 +61,28 @@ void CH1::step_volume() {
   }
 }
 
-void CH1::tick() {  
-  if(timer <= 0) {
-    timer = (2048 - frequency) << 2;
-    duty_index = (duty_index + 1) & 7;
-  }
-  
-  timer--;
-}
+void CH1::run(u32 time, u32 end_time, BlipOutput& out) {
+  s32 period = (2048 - frequency) << 2;
+  bool audible = out.audible(dac, nr14.enabled, current_volume != 0);
+  out.update(time, audible ? current_volume * duty[nr11.duty][duty_index] : 0);
 
-u8 CH1::sample() {
-  if(dac && nr14.enabled) {
-    return current_volume * this->duty[nr11.duty][duty_index];
+  u32 t = time + timer;
+  if(!audible) {
+    // Nothing to hear, skip straight to where the duty position ends up
+    if(t < end_time) {
+      u32 steps = (end_time - t) / period + 1;
+      duty_index = (duty_index + steps) & 7;
+      t += steps * period;
+    }
   } else {
-    return 0;
+    while(t < end_time) {
+      duty_index = (duty_index + 1) & 7;
+      out.update(t, current_volume * duty[nr11.duty][duty_index]);
+      t += period;
+    }
   }
+
+  timer = t - end_time;
 }
 
 void CH1::step_sweep() {
@@ -34,29 +34,39 @@ void CH3::reset()
   memset(wave_ram, 0, 16);
 }
 
-void CH3::tick() {
-  if(timer == 0) {
-    timer = (2048 - frequency) << 1;
-    wave_pos = (wave_pos + 1) & 31;
-  }
-
-  timer--;
-}
+void CH3::run(u32 time, u32 end_time, BlipOutput& out) {
+  s32 period = (2048 - frequency) << 1;
+  bool audible = out.audible(dac, nr34.enabled, vol_shift < 4);
+  // Wave RAM holds two samples per byte, high nibble first
+  auto amp = [&] {
+    return ((wave_ram[wave_pos >> 1] >> ((wave_pos & 1) ? 0 : 4)) & 0xF) >> vol_shift;
+  };
+  out.update(time, audible ? amp() : 0);
 
-u8 CH3::sample() {
-  if(dac && nr30.enabled) {
-    u8 sample = (wave_ram[wave_pos >> 1] >> ((wave_pos & 1) != 0 ? 4 : 0)) & 0xF;
-    return ((sample >> vol_shift) / 7) - 1;
+  u32 t = time + timer;
+  if(!audible) {
+    // Same as CH1, the position is all that has to come out right
+    if(t < end_time) {
+      u32 steps = (end_time - t) / period + 1;
+      wave_pos = (wave_pos + steps) & 31;
+      t += steps * period;
+    }
   } else {
-    return 0;
+    while(t < end_time) {
+      wave_pos = (wave_pos + 1) & 31;
+      out.update(t, amp());
+      t += period;
+    }
   }
+
+  timer = t - end_time;
 }
 
 void CH3::step_length() {
   if(nr34.len_enable && (length_counter > 0)) {
     length_counter--;
     if(length_counter == 0) {
-      nr30.enabled = 0;
+      nr34.enabled = 0;
     }
   }
 }
@@ -76,8 +86,9 @@ void CH3::write(u16 addr, u8 val) {
   switch(addr & 0xff) {
     case 0x1a:
       dac = ((val >> 7) & 1) != 0;
+      nr30.enabled = dac;
       if(!dac) {
-        nr30.enabled = 0;
+        nr34.enabled = 0;
       }
       break;
     case 0x1b:
@@ -95,8 +106,10 @@ void CH3::write(u16 addr, u8 val) {
       nr34.len_enable = (val >> 6) & 1;
       bool trigger = (val >> 7) != 0;
       if(trigger && dac) {
-        nr30.enabled = 1;
-        
+        nr34.enabled = 1;
+        wave_pos = 0;
+        timer = (2048 - frequency) << 1;
+
         if(length_counter == 0) {
           length_counter = 256;
         }
@@ -2,6 +2,65 @@
 
 namespace natsukashii::core
 {
+// One LFSR clock: bit 0 XOR bit 1 is shifted in at bit 14, in 7-bit mode also at bit 6.
+// The channel outputs the inverted bit 0
+static u16 lfsr_step(u16 lfsr, bool narrow) {
+  u16 x = (lfsr ^ (lfsr >> 1)) & 1;
+  lfsr = (lfsr >> 1) | (x << 14);
+  if(narrow) {
+    lfsr = (lfsr & ~0x40) | (x << 6);
+  }
+  return lfsr;
+}
+
+// The step is linear over GF(2), so n steps are a 15x15 bit matrix applied to the state.
+// For every power of two the matrix is kept byte-sliced: two lookups and a XOR per set bit of n,
+// so a silent channel costs the same whether it skips ten steps or ten thousand
+struct NoiseJump
+{
+  static constexpr int POWERS = 32;
+  u16 table[2][POWERS][2][256];
+
+  NoiseJump() {
+    for(int narrow = 0; narrow < 2; narrow++) {
+      u16 columns[15];
+      for(int j = 0; j < 15; j++) {
+        columns[j] = lfsr_step(1 << j, narrow);
+      }
+
+      for(int k = 0; k < POWERS; k++) {
+        for(int slice = 0; slice < 2; slice++) {
+          for(int b = 0; b < 256; b++) {
+            u16 result = 0;
+            for(int j = 0; j < 8 && slice * 8 + j < 15; j++) {
+              if(b & (1 << j)) result ^= columns[slice * 8 + j];
+            }
+            table[narrow][k][slice][b] = result;
+          }
+        }
+
+        // Squaring: 2^(k+1) steps is 2^k steps applied to the 2^k columns
+        for(int j = 0; j < 15; j++) {
+          columns[j] = apply(narrow, k, columns[j]);
+        }
+      }
+    }
+  }
+
+  u16 apply(int narrow, int k, u16 lfsr) const {
+    return table[narrow][k][0][lfsr & 0xff] ^ table[narrow][k][1][lfsr >> 8];
+  }
+
+  u16 jump(bool narrow, u16 lfsr, u32 steps) const {
+    for(int k = 0; steps; k++, steps >>= 1) {
+      if(steps & 1) lfsr = apply(narrow, k, lfsr);
+    }
+    return lfsr;
+  }
+};
+
+static const NoiseJump noise_jump;
+
 CH4::CH4()
 {
   nr41.raw = 0;
@@ -16,5 +75,111 @@ void CH4::reset()
   nr42.raw = 0;
   nr43.raw = 0;
   nr44.raw = 0;
+  timer = 0;
+  lfsr = 0x7fff;
+  period_timer = 0;
+  current_volume = 0;
+  length_counter = 0;
+  dac = false;
+}
+
+void CH4::step_length() {
+  if(nr44.selection && length_counter > 0) {
+    length_counter--;
+    if(length_counter == 0) {
+      nr44.enabled = 0;
+    }
+  }
+}
+
+void CH4::step_volume() {
+  if(nr42.sweep != 0) {
+    if(period_timer > 0) {
+      period_timer--;
+    }
+
+    if(period_timer == 0) {
+      period_timer = nr42.sweep;
+      if(current_volume < 0xF && nr42.dir) {
+        current_volume++;
+      } else if(current_volume > 0 && !nr42.dir) {
+        current_volume--;
+      }
+    }
+  }
+}
+
+void CH4::run(u32 time, u32 end_time, BlipOutput& out) {
+  // Shifts of 14 and 15 don't clock the LFSR at all
+  if(nr43.freq >= 14) {
+    timer = 0;
+    out.update(time, dac && nr44.enabled ? current_volume * (~lfsr & 1) : 0);
+    return;
+  }
+
+  u32 period = this->period();
+  bool narrow = nr43.step;
+  bool audible = out.audible(dac, nr44.enabled, current_volume != 0);
+  out.update(time, audible ? current_volume * (~lfsr & 1) : 0);
+
+  u32 t = time + timer;
+  if(!audible) {
+    if(t < end_time) {
+      u32 steps = (end_time - t) / period + 1;
+      lfsr = noise_jump.jump(narrow, lfsr, steps);
+      t += steps * period;
+    }
+  } else {
+    while(t < end_time) {
+      lfsr = lfsr_step(lfsr, narrow);
+      out.update(t, current_volume * (~lfsr & 1));
+      t += period;
+    }
+  }
+
+  timer = t - end_time;
+}
+
+u8 CH4::read(u16 addr) {
+  switch(addr & 0xff) {
+    case 0x20: return 0xff;
+    case 0x21: return nr42.raw;
+    case 0x22: return nr43.raw;
+    case 0x23: return ((u8)nr44.selection << 6) | 0xBF;
+  }
+  return 0xff;
+}
+
+void CH4::write(u16 addr, u8 val) {
+  switch(addr & 0xff) {
+    case 0x20:
+      nr41.raw = val;
+      length_counter = 64 - (val & 0x3F);
+      break;
+    case 0x21:
+      nr42.raw = val;
+      dac = (val & 0xF8) != 0;
+      if(!dac) {
+        nr44.enabled = 0;
+      }
+      break;
+    case 0x22:
+      nr43.raw = val;
+      break;
+    case 0x23: {
+      nr44.selection = (val >> 6) & 1;
+      bool trigger = val >> 7;
+      if(trigger && dac) {
+        if(length_counter == 0) {
+          length_counter = 64;
+        }
+        nr44.enabled = 1;
+        period_timer = nr42.sweep;
+        current_volume = nr42.initial_vol;
+        lfsr = 0x7fff;
+        timer = period();
+      }
+    } break;
+  }
+}
 }
-}
\ No newline at end of file
@@ -27,6 +27,13 @@ u8 Bus::ReadByte(u16 addr) {
     return ppu.ReadIO(addr);
   case 0xff10 ... 0xff3f:
     return apu.ReadIO(addr);
+  case 0xff00:
+    // The game sees the new input now, the next frame drawn is the first that can show it
+    if(mem.unread_input) {
+      ppu.InputRead(mem.unread_input);
+      mem.unread_input = 0;
+    }
+    return mem.Read(addr);
   default:
     return mem.Read(addr);
   }
@@ -55,10 +62,10 @@ u16 Bus::NextHalf(u16& pc, u8& cycles) {
 void Bus::WriteByte(u16 addr, u8 val) {
   switch(addr) {
   case 0x8000 ... 0x9fff:
-    if(!ppu.vram_lock) ppu.vram[addr & 0x1fff] = val;
+    if(!ppu.vram_lock) ppu.WriteVRAM(addr, val);
     break;
   case 0xfe00 ... 0xfe9f:
-    if(!ppu.oam_lock) ppu.oam[addr & 0xff] = val;
+    if(!ppu.oam_lock) ppu.WriteOAM(addr, val);
     break;
   case 0xff40 ... 0xff4b:
     ppu.WriteIO(mem, addr, val, mem.io.intf);
@@ -76,13 +83,15 @@ void Bus::WriteHalf(u16 addr, u16 val) {
   WriteByte(addr, val);
 }
 
-void Bus::SaveState(std::ofstream& savestate) {
-  mem.SaveState(savestate);
-  ppu.SaveState(savestate);
+void Bus::SaveState(StateWriter& state) {
+  mem.SaveState(state);
+  ppu.SaveState(state);
+  apu.SaveState(state);
 }
 
-void Bus::LoadState(std::ifstream& loadstate) {
-  mem.LoadState(loadstate);
-  ppu.LoadState(loadstate);
+void Bus::LoadState(StateReader& state) {
+  mem.LoadState(state);
+  ppu.LoadState(state);
+  apu.LoadState(state);
 }
 }  // namespace natsukashii::core
\ No newline at end of file
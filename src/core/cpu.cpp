@@ -40,32 +40,23 @@ void Cpu::Reset()
   }
 }
 
-void Cpu::SaveState(int slot) {
-  namespace fs = std::filesystem;
-  if(!fs::exists(fs::absolute("savestates"))) {
-    fs::create_directory("savestates");
-  }
-
-  if(!bus->mem.savefile.empty()) {
-    std::ofstream savestate{fs::absolute("savestates/").string() + bus->mem.savefile + std::to_string(slot), std::ios::binary};
-    savestate.unsetf(std::ios::skipws);
-    bus->SaveState(savestate);
-    savestate.close();
-  }
+// Only the CPU's own registers, the bus and everything on it is saved by Core
+void Cpu::SaveState(StateWriter& state) {
+  state.Write(regs);
+  state.Write(halt);
+  state.Write(ime);
+  state.Write(ei);
+  state.Write(tima_cycles);
+  state.Write(div_cycles);
 }
 
-void Cpu::LoadState(int slot) {
-  namespace fs = std::filesystem;
-  if(!fs::exists(fs::absolute("savestates"))) {
-    fs::create_directory("savestates");
-  }
-
-  if(!bus->mem.savefile.empty()) {
-    std::ifstream loadstate{fs::absolute("savestates/").string() + bus->mem.savefile + std::to_string(slot), std::ios::binary};
-    loadstate.unsetf(std::ios::skipws);
-    bus->LoadState(loadstate);
-    loadstate.close();
-  }
+void Cpu::LoadState(StateReader& state) {
+  state.Read(regs);
+  state.Read(halt);
+  state.Read(ime);
+  state.Read(ei);
+  state.Read(tima_cycles);
+  state.Read(div_cycles);
 }
 
 
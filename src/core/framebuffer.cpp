@@ -0,0 +1,42 @@
+#include "framebuffer.h"
+
+namespace natsukashii::core
+{
+void TripleBuffer::Resize(size_t size) {
+  for(auto& buffer : buffers) {
+    buffer.assign(size, 0);
+    buffer.shrink_to_fit();
+  }
+
+  middle = 1;
+  back = 0;
+  front = 2;
+  tags.fill(0);
+  front_tag = seen_tag = 0;
+}
+
+void TripleBuffer::Publish(u64 tag) {
+  // The reader only ever reads tags, so peeking at the spare's is safe even if it gets acquired right now.
+  // Then the tag shows up twice, Acquire drops the repeat. The older tag wins, it has waited longer
+  u8 spare = middle.load(std::memory_order_acquire);
+  u64 unseen = (spare & FRESH) ? tags[spare & 3] : 0;
+  tags[back] = unseen ? unseen : tag;
+  back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & 3;
+  if(on_publish) {
+    on_publish();
+  }
+}
+
+bool TripleBuffer::Acquire() {
+  if(!(middle.load(std::memory_order_relaxed) & FRESH)) {
+    return false;
+  }
+
+  front = middle.exchange(front, std::memory_order_acq_rel) & 3;
+  front_tag = tags[front] != seen_tag ? tags[front] : 0;
+  if(front_tag) {
+    seen_tag = front_tag;
+  }
+  return true;
+}
+} // natsukashii::core
@@ -136,4 +136,22 @@ void MBC1::Save(const std::string& filename)
   fwrite(ram.data(), 1, EXTRAM_SZ, file);
   fclose(file);
 }
+
+void MBC1::SaveState(StateWriter& state)
+{
+  state.Write(romBank);
+  state.Write(ramBank);
+  state.Write(mode);
+  state.Write(ramEnable);
+  state.Write(ram);
+}
+
+void MBC1::LoadState(StateReader& state)
+{
+  state.Read(romBank);
+  state.Read(ramBank);
+  state.Read(mode);
+  state.Read(ramEnable);
+  state.Read(ram);
+}
 } // natsukashii::core
\ No newline at end of file
@@ -61,4 +61,18 @@ void MBC2::Save(const std::string& filename)
   fwrite(ram.data(), 1, EXTRAM_SZ, file);
   fclose(file);
 }
+
+void MBC2::SaveState(StateWriter& state)
+{
+  state.Write(romBank);
+  state.Write(ramEnable);
+  state.Write(ram);
+}
+
+void MBC2::LoadState(StateReader& state)
+{
+  state.Read(romBank);
+  state.Read(ramEnable);
+  state.Read(ram);
+}
 } // natsukashii::core
\ No newline at end of file
@@ -63,4 +63,20 @@ void MBC3::Save(const std::string& filename)
   fwrite(ram.data(), 1, EXTRAM_SZ, file);
   fclose(file);
 }
+
+void MBC3::SaveState(StateWriter& state)
+{
+  state.Write(romBank);
+  state.Write(ramBank);
+  state.Write(ramEnable);
+  state.Write(ram);
+}
+
+void MBC3::LoadState(StateReader& state)
+{
+  state.Read(romBank);
+  state.Read(ramBank);
+  state.Read(ramEnable);
+  state.Read(ram);
+}
 } // natsukashii::core
\ No newline at end of file
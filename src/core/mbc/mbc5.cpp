@@ -64,4 +64,20 @@ void MBC5::Save(const std::string& filename)
   fwrite(ram.data(), 1, EXTRAM_SZ, file);
   fclose(file);
 }
+
+void MBC5::SaveState(StateWriter& state)
+{
+  state.Write(romBank);
+  state.Write(ramBank);
+  state.Write(ramEnable);
+  state.Write(ram);
+}
+
+void MBC5::LoadState(StateReader& state)
+{
+  state.Read(romBank);
+  state.Read(ramBank);
+  state.Read(ramEnable);
+  state.Read(ram);
+}
 } // natsukashii::core
\ No newline at end of file
@@ -10,22 +10,35 @@ Mem::~Mem()
     cart->Save(savefile);
 }
 
-void Mem::SaveState(std::ofstream& savestate) {
+void Mem::SaveState(StateWriter& state) {
   if(cart != nullptr)
-    savestate.write((char*)cart->GetRAM(), EXTRAM_SZ);
-  
-  savestate.write((char*)wram, WRAM_SZ);
-  savestate.write((char*)hram, HRAM_SZ);
-  savestate.write((char*)&ie, 1);
+    cart->SaveState(state);
+
+  state.Write(io);
+  state.Write(ie);
+  state.Write(wram);
+  state.Write(hram);
+  state.Write(buttons);
+  state.Write(dpad);
+  state.Write(button);
 }
 
-void Mem::LoadState(std::ifstream& loadstate) {
+void Mem::LoadState(StateReader& state) {
   if(cart != nullptr)
-    cart->SetRam(loadstate);
-  
-  loadstate.read((char*)wram, WRAM_SZ);
-  loadstate.read((char*)hram, HRAM_SZ);
-  loadstate.read((char*)&ie, 1);
+    cart->LoadState(state);
+
+  state.Read(io);
+  state.Read(ie);
+  state.Read(wram);
+  state.Read(hram);
+  state.Read(buttons);
+  state.Read(dpad);
+  state.Read(button);
+  unread_input = 0;
+}
+
+u16 Mem::RomChecksum() const {
+  return rom.size() > 0x14f ? (rom[0x14e] << 8) | rom[0x14f] : 0;
 }
 
 Mem::Mem(bool skip, std::string bootrom_path) : skip(skip)
@@ -58,6 +71,7 @@ void Mem::Reset()
   io.intf = 0;
   io.div = 0;
   io.joy.raw = 0xff;
+  unread_input = 0;
 
   io.bootrom = skip ? 1 : 0;
 
@@ -241,37 +255,34 @@ void Mem::HandleJoypad(u8 val)
 {
   button = !bit<u8, 5>(val);
   dpad = !bit<u8, 4>(val);
+  UpdateJoypad();
+}
+
+void Mem::SetButton(u8 mask, bool pressed, u64 host_time)
+{
+  u8 old = buttons;
+  buttons = pressed ? buttons | mask : buttons & ~mask;
+  if(buttons != old && !unread_input) {
+    unread_input = host_time;
+  }
+  UpdateJoypad();
 }
 
-void Mem::DoInputs(int key)
+void Mem::UpdateJoypad()
 {
-  u8 input = ((u8)(!button) << 5) | ((u8)(!dpad) << 4);
-  u8 cond = (button << 1) | dpad;
+  u8 lines = 0xf;
+  if(button) {
+    lines &= ~buttons & 0xf;
+  }
+  if(dpad) {
+    lines &= ~(buttons >> 4) & 0xf;
+  }
 
-  switch(cond) {
-  case 0b00:
-    input |= 0xff;
-    break;
-  case 0b01:
-    input |= (!(key == GLFW_KEY_DOWN ) << 3) |
-             (!(key == GLFW_KEY_UP   ) << 2) |
-             (!(key == GLFW_KEY_LEFT ) << 1) |
-             (!(key == GLFW_KEY_RIGHT) << 0);
-    break;
-  case 0b10:
-    input |= (!(key == GLFW_KEY_ENTER      ) << 3) |
-             (!(key == GLFW_KEY_RIGHT_SHIFT) << 2) |
-             (!(key == GLFW_KEY_Z          ) << 1) |
-             (!(key == GLFW_KEY_X          ) << 0);
-    break;
-  case 0b11:
-    input |= (!((key == GLFW_KEY_DOWN  || key == GLFW_KEY_ENTER      )) << 3) |
-             (!((key == GLFW_KEY_UP    || key == GLFW_KEY_RIGHT_SHIFT)) << 2) |
-             (!((key == GLFW_KEY_LEFT  || key == GLFW_KEY_Z          )) << 1) |
-             (!((key == GLFW_KEY_RIGHT || key == GLFW_KEY_X          )) << 0);
-    break;
+  // Any P1 input line going from high to low requests the joypad interrupt
+  if(io.joy.raw & ~lines & 0xf) {
+    io.intf |= 0x10;
   }
 
-  io.joy.write(input);
+  io.joy.write(((u8)(!button) << 5) | ((u8)(!dpad) << 4) | lines);
 }
 }  // namespace natsukashii::core
\ No newline at end of file
@@ -15,6 +15,8 @@ Ppu::Ppu(bool skip) : skip(skip)
   io.wx = 0;
   io.wy = 0;
   io.ly = 0;
+  dirty_lines.set();
+  SetPixelFormat(PixelFormat::RGBA);
 
   if (skip)
   {
@@ -32,22 +34,219 @@ Ppu::Ppu(bool skip) : skip(skip)
   }
 }
 
-void Ppu::SaveState(std::ofstream& savestate) {
-  savestate.write((char*)vram, VRAM_SZ);
-  savestate.write((char*)oam, OAM_SZ);
+Ppu::Ppu(const Ppu& parent, TripleBuffer& output) : skip(parent.skip)
+{
+  io = parent.io;
+  pixel_format = parent.pixel_format;
+  pixels = output.Back();
+  on_line = parent.on_line;
+  this->output = &output;
+  memcpy(vram, parent.vram, VRAM_SZ);
+  memcpy(oam, parent.oam, OAM_SZ);
+  dirty_lines.set();
+}
+
+Ppu::~Ppu()
+{
+  SetRenderOffload(false);
+}
+
+void Ppu::SetPixelFormat(PixelFormat format)
+{
+  // The worker holds on to the old buffers, restart it around the resize
+  bool offloaded = worker != nullptr;
+  SetRenderOffload(false);
+  pixel_format = format;
+  frames.Resize(FrameSize(format));
+  ClearFrame();
+  SetRenderOffload(offloaded);
+}
+
+void Ppu::SetRenderOffload(bool enable)
+{
+  if (enable == (worker != nullptr))
+  {
+    return;
+  }
+
+  if (enable)
+  {
+    worker.reset(new Ppu(*this, frames));
+    // Two frames' worth of writes even if every VRAM byte changed
+    log = std::make_unique<RingBuffer<PpuLogEntry>>(1 << 16);
+    worker_running = true;
+    worker_thread = std::thread([this] { ReplayLoop(); });
+  }
+  else
+  {
+    worker_running = false;
+    worker_cv.notify_one();
+    worker_thread.join();
+    worker.reset();
+    log.reset();
+    pixels = frames.Back();
+  }
+}
+
+void Ppu::SetLineCallback(LineCallback callback)
+{
+  on_line = std::move(callback);
+  if (worker)
+  {
+    worker->on_line = on_line;
+  }
+}
+
+void Ppu::Log(const PpuLogEntry& entry)
+{
+  // Only full if the worker stalled for frames, a lost write would corrupt every later frame
+  while (!log->Push(&entry, 1))
+  {
+    std::this_thread::yield();
+  }
 }
 
-void Ppu::LoadState(std::ifstream& loadstate) {
-  loadstate.read((char*)vram, VRAM_SZ);
-  loadstate.read((char*)oam, OAM_SZ);
+// Worker thread, woken at every VBlank. A missed notify only costs the wait timeout
+void Ppu::ReplayLoop()
+{
+  PpuLogEntry entries[256];
+  while (true)
+  {
+    size_t count = log->Pop(entries, 256);
+    for (size_t i = 0; i < count; i++)
+    {
+      worker->Replay(entries[i]);
+    }
+
+    if (count)
+    {
+      continue;
+    }
+
+    if (!worker_running)
+    {
+      break;
+    }
+
+    std::unique_lock<std::mutex> lock(worker_mutex);
+    worker_cv.wait_for(lock, std::chrono::milliseconds(5));
+  }
+}
+
+void Ppu::Replay(const PpuLogEntry& entry)
+{
+  switch (entry.kind)
+  {
+  case PpuLogKind::Vram:
+    vram[entry.addr] = entry.val;
+    break;
+  case PpuLogKind::Oam:
+    WriteOAM(entry.addr, entry.val);
+    break;
+  case PpuLogKind::Line:
+    if ((io.lcdc.raw ^ entry.lcdc) & 4)
+    {
+      dirty_lines.set();
+    }
+    io.lcdc.raw = entry.lcdc;
+    io.ly = entry.ly;
+    io.scy = entry.scy;
+    io.scx = entry.scx;
+    io.wy = entry.wy;
+    io.wx = entry.wx;
+    io.bgp = entry.bgp;
+    io.obp0 = entry.obp0;
+    io.obp1 = entry.obp1;
+    window_internal_counter = entry.window_counter;
+    RenderLine();
+    LineDone(io.ly);
+    break;
+  case PpuLogKind::Publish:
+    PublishFrame(entry.input_time);
+    break;
+  case PpuLogKind::Reset:
+    Reset();
+    break;
+  }
+}
+
+void Ppu::ClearFrame()
+{
+  pixels = output->Back();
+  switch (pixel_format)
+  {
+  case PixelFormat::RGBA:
+    std::fill_n((u32*)pixels, FBSIZE, colors[3]);
+    break;
+  case PixelFormat::Shade8:
+    std::fill_n(pixels, FBSIZE, 3);
+    break;
+  case PixelFormat::Shade2bpp:
+    std::fill_n(pixels, FBSIZE / 4, 0xff);
+    break;
+  }
+
+  PublishFrame();
+}
+
+void Ppu::PublishFrame(u64 tag)
+{
+  output->Publish(tag);
+  pixels = output->Back();
+}
+
+// Pixels aren't part of the state, a frame that is half drawn when loading finishes with the loaded lines
+void Ppu::SaveState(StateWriter& state)
+{
+  state.Write(vram);
+  state.Write(oam);
+  state.Write(io);
+  state.Write(mode);
+  state.Write(window_internal_counter);
+  state.Write(oam_lock);
+  state.Write(vram_lock);
+}
+
+void Ppu::LoadState(StateReader& state)
+{
+  state.Read(vram);
+  state.Read(oam);
+  state.Read(io);
+  state.Read(mode);
+  state.Read(window_internal_counter);
+  state.Read(oam_lock);
+  state.Read(vram_lock);
+  input_time = 0;
+  dirty_lines.set();
+
+  if (worker)
+  {
+    for (u16 i = 0; i < VRAM_SZ; i++)
+    {
+      Log({PpuLogKind::Vram, vram[i], i});
+    }
+    for (u16 i = 0; i < OAM_SZ; i++)
+    {
+      Log({PpuLogKind::Oam, oam[i], i});
+    }
+  }
 }
 
 void Ppu::Reset()
 {
   fbIndex = 0;
   mode = OAM;
+  input_time = frame_input_time = 0;
 
-  memset(pixels, colors[3], FBSIZE);
+  if (worker)
+  {
+    Log({PpuLogKind::Reset});
+    worker_cv.notify_one();
+  }
+  else
+  {
+    ClearFrame();
+  }
   memset(vram, 0, VRAM_SZ);
   memset(oam, 0, OAM_SZ);
 
@@ -57,6 +256,7 @@ void Ppu::Reset()
   io.wx = 0;
   io.wy = 0;
   io.ly = 0;
+  dirty_lines.set();
 
   if (skip)
   {
@@ -87,6 +287,11 @@ void Ppu::DispatchEvents(u64 time, Scheduler& scheduler, u8 &intf)
 {
   if (!io.lcdc.enabled)
   {
+    // Keep ticking while the LCD is off so it picks up again at line 0 once re-enabled
+    io.ly = 0;
+    window_internal_counter = 0;
+    mode = OAM;
+    scheduler.push(Entry(time + 456, Event::PPU));
     return;
   }
 
@@ -111,6 +316,7 @@ void Ppu::DispatchEvents(u64 time, Scheduler& scheduler, u8 &intf)
     if (io.ly == 154) {
       io.ly = 0;
       window_internal_counter = 0;
+      StartFrame();
       ChangeMode(time, scheduler, OAM, intf);
     } else {
       scheduler.push(Entry(time +  456, Event::PPU));
@@ -132,6 +338,10 @@ void Ppu::ChangeMode(u64 time, Scheduler& scheduler, Mode m, u8 &intf)
   {
   case HBlank:
     scheduler.push(Entry(time + 204, Event::PPU));
+    if (render_frame && !worker)
+    {
+      LineDone(io.ly);
+    }
     if (io.stat.hblank_int)
     {
       intf |= 2;
@@ -139,6 +349,17 @@ void Ppu::ChangeMode(u64 time, Scheduler& scheduler, Mode m, u8 &intf)
     break;
   case VBlank:
     scheduler.push(Entry(time +  456, Event::PPU));
+    if (render_frame && worker)
+    {
+      PpuLogEntry entry{PpuLogKind::Publish};
+      entry.input_time = frame_input_time;
+      Log(entry);
+      worker_cv.notify_one();
+    }
+    else if (render_frame)
+    {
+      PublishFrame(frame_input_time);
+    }
     intf |= 1;
     if (io.stat.vblank_int)
     {
@@ -154,7 +375,6 @@ void Ppu::ChangeMode(u64 time, Scheduler& scheduler, Mode m, u8 &intf)
     break;
   case LCDTransfer:
     scheduler.push(Entry(time + 172, Event::PPU));
-    render = true;
     Scanline();
     break;
   }
@@ -198,9 +418,15 @@ void Ppu::WriteIO(Mem &mem, u16 addr, u8 val, u8 &intf)
   case 0x40:
     io.old_lcdc.raw = io.lcdc.raw;
     io.lcdc.raw = val;
+    if (io.old_lcdc.obj_size != io.lcdc.obj_size)
+    {
+      dirty_lines.set();
+    }
     if (!io.old_lcdc.enabled && io.lcdc.enabled)
     {
       intf |= 2;
+      // Back at line 0 of a new frame, the render-skip decision and input tag are taken here too
+      StartFrame();
     }
     break;
   case 0x41:
@@ -220,7 +446,7 @@ void Ppu::WriteIO(Mem &mem, u16 addr, u8 val, u8 &intf)
     u16 start = (u16)val << 8;
     for (u8 i = 0; i < 0xa0; i++)
     {
-      oam[i] = mem.Read(start | i);
+      WriteOAM(i, mem.Read(start | i));
     }
   }
   break;
@@ -244,15 +470,95 @@ void Ppu::WriteIO(Mem &mem, u16 addr, u8 val, u8 &intf)
   }
 }
 
+void Ppu::LineDone(u8 ly)
+{
+  if (on_line)
+  {
+    on_line(ly, pixels + ly * (FrameSize(pixel_format) / HEIGHT));
+  }
+}
+
+void Ppu::StartFrame()
+{
+  frame_count++;
+  bool requested = frame_requested.exchange(false);
+  bool due = requested || (render_interval != 0 && (frame_count % render_interval) == 0);
+  render_frame = due && !drop_frames;
+  frames_dropped += due && drop_frames;
+  if (render_frame)
+  {
+    frame_input_time = input_time;
+    input_time = 0;
+  }
+}
+
 void Ppu::Scanline()
+{
+  // Every line, drawn or not: which sprites land on it is machine state, not pixel work
+  FetchSprites();
+
+  if (render_frame && worker)
+  {
+    Log({PpuLogKind::Line, 0, 0, io.ly, io.scy, io.scx, io.wy, io.wx, io.lcdc.raw,
+         io.bgp, io.obp0, io.obp1, window_internal_counter});
+  }
+  else if (render_frame)
+  {
+    DrawLine();
+  }
+
+  if (io.lcdc.window_enable && io.ly >= io.wy && io.wx <= 168)
+  {
+    window_internal_counter++;
+  }
+}
+
+// Worker side, it replays lines without going through Scanline
+void Ppu::RenderLine()
+{
+  FetchSprites();
+  DrawLine();
+}
+
+void Ppu::DrawLine()
 {
   RenderBGs();
   RenderSprites();
+  WriteLine();
 }
 
-void Ppu::RenderBGs()
+void Ppu::WriteLine()
 {
   fbIndex = io.ly * WIDTH;
+  switch (pixel_format)
+  {
+  case PixelFormat::RGBA:
+  {
+    u32* out = (u32*)pixels + fbIndex;
+    for (int x = 0; x < WIDTH; x++)
+    {
+      out[x] = colors[line[x + 8]];
+    }
+  }
+  break;
+  case PixelFormat::Shade8:
+    memcpy(&pixels[fbIndex], &line[8], WIDTH);
+    break;
+  case PixelFormat::Shade2bpp:
+  {
+    u8* out = &pixels[fbIndex / 4];
+    for (int x = 8; x < WIDTH + 8; x += 4)
+    {
+      *out++ = (line[x] << 6) | (line[x + 1] << 4) | (line[x + 2] << 2) | line[x + 3];
+    }
+  }
+  break;
+  }
+}
+
+void Ppu::RenderBGs()
+{
+  memset(bg_mask, 0, sizeof(bg_mask));
   u16 bg_tilemap = io.lcdc.bg_tilemap_area == 1 ? 0x9C00 : 0x9800;
   u16 window_tilemap = io.lcdc.window_tilemap_area == 1 ? 0x9C00 : 0x9800;
   u16 tiledata = io.lcdc.bgwin_tiledata_area == 1 ? 0x8000 : 0x8800;
@@ -283,11 +589,11 @@ void Ppu::RenderBGs()
 
       if (tiledata == 0x8000)
       {
-        tileline = *(u16*)&vram[tiledata + ((u16)index << 4) + ((u16)(scrolled_y & 7) << 1)];
+        tileline = *(u16*)&vram[(tiledata + ((u16)index << 4) + ((u16)(scrolled_y & 7) << 1)) & 0x1fff];
       }
       else
       {
-        tileline = *(u16*)&vram[0x9000 + s16((s8)index) * 16 + ((u16)(scrolled_y & 7) << 1)];
+        tileline = *(u16*)&vram[(0x9000 + s16((s8)index) * 16 + ((u16)(scrolled_y & 7) << 1)) & 0x1fff];
       }
     }
 
@@ -296,36 +602,111 @@ void Ppu::RenderBGs()
 
     u8 colorID = (bit<u8>(high, 7 - (scrolled_x & 7)) << 1) | (bit<u8>(low, 7 - (scrolled_x & 7)));
     u8 color_index = (io.bgp >> (colorID << 1)) & 3;
-    colorIDbg[fbIndex] = colorID;
-    pixels[fbIndex] = colors[color_index];
-    fbIndex++;
+    line[x + 8] = color_index;
+    bg_mask[(x >> 3) + 1] |= (colorID != 0) << (7 - (x & 7));
+  }
+}
+
+void Ppu::WriteVRAM(u16 addr, u8 val)
+{
+  u16 index = addr & 0x1fff;
+  if (vram[index] == val)
+  {
+    return;
   }
 
-  if (render_window && io.ly >= io.wy && io.wx >= 0 && io.wx <= 168)
+  vram[index] = val;
+  if (worker)
   {
-    window_internal_counter++;
+    Log({PpuLogKind::Vram, val, index});
   }
 }
 
-void Ppu::FetchSprites()
+void Ppu::WriteOAM(u16 addr, u8 val)
+{
+  u8 index = addr & 0xff;
+  if (oam[index] == val)
+  {
+    return;
+  }
+
+  // Offloaded the worker keeps its own cache for drawing, ours still decides the sprites per line
+  if (worker)
+  {
+    Log({PpuLogKind::Oam, val, index});
+  }
+
+  // Only Y and X decide which lines a sprite lands on and in which order,
+  // tile and attribute writes are picked up at render time
+  if ((index & 3) < 2)
+  {
+    InvalidateSprite(oam[index & ~3]);
+    oam[index] = val;
+    InvalidateSprite(oam[index & ~3]);
+  }
+  else
+  {
+    oam[index] = val;
+  }
+}
+
+void Ppu::InvalidateSprite(u8 oam_y)
+{
+  // Always assume 8x16 so obj_size doesn't matter here, changing it dirties everything anyway
+  for (int y = oam_y - 16; y < oam_y; y++)
+  {
+    if (y >= 0 && y < HEIGHT)
+    {
+      dirty_lines[y] = true;
+    }
+  }
+}
+
+void Ppu::BuildSpriteLine(u8 ly)
 {
-  sprites.fill(Sprite());
-  count = 0;
   u8 height = io.lcdc.obj_size ? 16 : 8;
+  u8& n = line_sprite_count[ly];
+  auto& entries = line_sprites[ly];
+  n = 0;
 
-  for (int i = 0; i < 0xa0 && count < 10; i += 4)
+  for (int i = 0; i < 40 && n < 10; i++)
   {
-    Sprite sprite(oam[i] - 16, oam[i + 1] - 8, oam[i + 2], oam[i + 3]);
-    if (io.ly >= (s16)sprite.ypos && io.ly < ((s16)sprite.ypos + height))
+    u8 y = oam[i * 4];
+    if (ly + 16 >= y && ly + 16 < y + height)
     {
-      sprites[count] = sprite;
-      count++;
+      entries[n++] = i;
     }
   }
 
-  std::stable_sort(sprites.begin(), sprites.begin() + count, [](Sprite a, Sprite b) {
-    return b.xpos <= a.xpos;
+  // Lower X wins, ties go to the lower OAM index
+  std::stable_sort(entries.begin(), entries.begin() + n, [this](u8 a, u8 b) {
+    return oam[a * 4 + 1] < oam[b * 4 + 1];
   });
+
+  dirty_lines[ly] = false;
+}
+
+void Ppu::FetchSprites()
+{
+  if (dirty_lines[io.ly])
+  {
+    BuildSpriteLine(io.ly);
+  }
+
+  count = line_sprite_count[io.ly];
+  for (int i = 0; i < count; i++)
+  {
+    u8 index = line_sprites[io.ly][i] * 4;
+    sprites[i] = Sprite(oam[index] - 16, oam[index + 1] - 8, oam[index + 2], oam[index + 3]);
+  }
+}
+
+static inline u8 flip(u8 b)
+{
+  b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+  b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+  b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+  return b;
 }
 
 void Ppu::RenderSprites()
@@ -333,49 +714,62 @@ void Ppu::RenderSprites()
   if (!io.lcdc.obj_enable)
     return;
 
-  FetchSprites();
+  memset(obj_mask, 0, sizeof(obj_mask));
 
+  // Highest priority first: a sprite only draws where no earlier sprite was opaque
   for (int i = 0; i < count; i++)
   {
-    u16 tile_y;
-    if (io.lcdc.obj_size)
-    {
-      tile_y = (sprites[i].attribs.yflip) ? ((io.ly - sprites[i].ypos) ^ 15) : io.ly - sprites[i].ypos;
-    }
-    else
+    // line is offset by 8, so the raw OAM X is the line position
+    u8 pos = sprites[i].xpos + 8;
+    if (pos >= WIDTH + 8)
     {
-      tile_y = (sprites[i].attribs.yflip) ? ((io.ly - sprites[i].ypos) ^ 7) & 7 : (io.ly - sprites[i].ypos) & 7;
+      continue;
     }
 
+    // u8 math so sprites partially above line 0 still get the right row
+    u8 row_mask = io.lcdc.obj_size ? 15 : 7;
+    u8 row = io.ly - sprites[i].ypos;
+    u16 tile_y = ((sprites[i].attribs.yflip) ? row ^ row_mask : row) & row_mask;
+
     u8 pal = (sprites[i].attribs.palnum) ? io.obp1 : io.obp0;
-    fbIndex = sprites[i].xpos + WIDTH * io.ly;
     u16 tile_index = io.lcdc.obj_size ? sprites[i].tileidx & ~1 : sprites[i].tileidx;
-    u16 tile = *(u16*)&vram[0x8000 | ((tile_index << 4) + (tile_y << 1))];
+    u16 tile = *(u16*)&vram[((tile_index << 4) + (tile_y << 1)) & 0x1fff];
+    u8 high = tile >> 8;
+    u8 low = tile & 0xff;
 
-    for (int x = 0; x < 8; x++)
+    if (sprites[i].attribs.xflip)
     {
-      s8 tile_x = (sprites[i].attribs.xflip) ? 7 - x : x;
-      u8 high = tile >> 8;
-      u8 low = tile & 0xff;
-      u8 colorID = (bit<u8>(high, 7 - tile_x) << 1) | bit<u8>(low, 7 - tile_x);
-      u8 colorIndex = (pal >> (colorID << 1)) & 3;
+      high = flip(high);
+      low = flip(low);
+    }
 
-      if ((sprites[i].xpos + x) < 166 && colorID != 0 && pixels[fbIndex] != colors[colorIndex])
-      {
-        if (sprites[i].attribs.obj_to_bg_prio)
-        {
-          if (colorIDbg[fbIndex] < 1)
-          {
-            pixels[fbIndex] = colors[colorIndex];
-          }
-        }
-        else
-        {
-          pixels[fbIndex] = colors[colorIndex];
-        }
-      }
+    // Pull the 8 pixel lane under the sprite out of the line masks
+    u8 byte = pos >> 3, shift = 8 - (pos & 7);
+    u8 claimed = (((u16)obj_mask[byte] << 8) | obj_mask[byte + 1]) >> shift;
+    u8 behind = (((u16)bg_mask[byte] << 8) | bg_mask[byte + 1]) >> shift;
+
+    u8 opaque = high | low;
+    u8 visible = opaque & ~claimed;
+    if (sprites[i].attribs.obj_to_bg_prio)
+    {
+      visible &= ~behind;
+    }
 
-      fbIndex++;
+    // Opaque pixels are taken even when hidden behind the BG, lower priority sprites can't show through
+    u16 claim = (u16)opaque << shift;
+    obj_mask[byte] |= claim >> 8;
+    obj_mask[byte + 1] |= claim & 0xff;
+
+    if (visible == 0)
+    {
+      continue;
+    }
+
+    u8 shades[4] = { u8(pal & 3), u8((pal >> 2) & 3), u8((pal >> 4) & 3), u8((pal >> 6) & 3) };
+    for (int x = 0; x < 8; x++)
+    {
+      u8 colorID = (bit<u8>(high, 7 - x) << 1) | bit<u8>(low, 7 - x);
+      line[pos + x] = bit<u8>(visible, 7 - x) ? shades[colorID] : line[pos + x];
     }
   }
 }
@@ -3,6 +3,11 @@
 
 namespace natsukashii::core {
 Scheduler::Scheduler() {
+  reset();
+}
+
+void Scheduler::reset() {
+  entries.fill(Entry());
   entries[0].time = UINT64_MAX;
   entries[0].event = Event::Panic;
   pos = 1;
@@ -0,0 +1,233 @@
+#include "frametexture.h"
+#include <string.h>
+
+// Not in the 3.3 core loader, fetched at runtime when the driver has GL_ARB_buffer_storage
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void* data, GLbitfield flags);
+
+namespace natsukashii::frontend
+{
+static const char* palette_vs = R"(#version 330 core
+void main() {
+  // One triangle covering the whole target
+  vec2 pos = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+  gl_Position = vec4(pos * 2.0 - 1.0, 0.0, 1.0);
+}
+)";
+
+static const char* palette_fs = R"(#version 330 core
+uniform sampler2D shades;
+uniform vec4 palette[4];
+out vec4 color;
+void main() {
+  // Shade texel row n lands in output row n, the same layout an RGBA upload has
+  int shade = int(texelFetch(shades, ivec2(gl_FragCoord.xy), 0).r * 255.0 + 0.5);
+  color = palette[shade & 3];
+}
+)";
+
+static unsigned int compile_shader(GLenum type, const char* source) {
+  unsigned int shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, nullptr);
+  glCompileShader(shader);
+
+  int ok = 0;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+  if(!ok) {
+    char log[512];
+    glGetShaderInfoLog(shader, sizeof(log), nullptr, log);
+    fprintf(stderr, "Palette shader failed to compile: %s\n", log);
+  }
+  return shader;
+}
+
+FrameTexture::~FrameTexture() {
+  Destroy();
+}
+
+void FrameTexture::Destroy() {
+  if(!id) {
+    return;
+  }
+
+  for(int i = 0; i < PBO_COUNT; i++) {
+    if(fences[i]) {
+      glDeleteSync(fences[i]);
+      fences[i] = nullptr;
+    }
+
+    if(mapped[i]) {
+      glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+      glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+      mapped[i] = nullptr;
+    }
+  }
+
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(PBO_COUNT, pbos);
+  memset(pbos, 0, sizeof(pbos));
+  glDeleteTextures(1, &id);
+  id = 0;
+
+  if(shades) {
+    glDeleteTextures(1, &shades);
+    glDeleteFramebuffers(1, &fbo);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteProgram(program);
+    shades = fbo = vao = program = 0;
+  }
+}
+
+void FrameTexture::Init(PixelFormat pixel_format, const u8* initial) {
+  Destroy();
+  format = pixel_format;
+  size = FrameSize(format);
+
+  glGenTextures(1, &id);
+  glBindTexture(GL_TEXTURE_2D, id);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, WIDTH, HEIGHT, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8,
+    format == PixelFormat::RGBA ? initial : nullptr);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+
+  auto glBufferStorage = glfwExtensionSupported("GL_ARB_buffer_storage") ?
+    (PFNGLBUFFERSTORAGEPROC)glfwGetProcAddress("glBufferStorage") : nullptr;
+  persistent = glBufferStorage != nullptr;
+
+  glGenBuffers(PBO_COUNT, pbos);
+  for(int i = 0; i < PBO_COUNT; i++) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbos[i]);
+    if(persistent) {
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+      mapped[i] = (u8*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+    } else {
+      glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    }
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if(format == PixelFormat::Shade8) {
+    glGenTextures(1, &shades);
+    glBindTexture(GL_TEXTURE_2D, shades);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, WIDTH, HEIGHT, 0, GL_RED, GL_UNSIGNED_BYTE, initial);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    InitPalettePass();
+    SetPalette(colors);
+  }
+}
+
+void FrameTexture::InitPalettePass() {
+  unsigned int vs = compile_shader(GL_VERTEX_SHADER, palette_vs);
+  unsigned int fs = compile_shader(GL_FRAGMENT_SHADER, palette_fs);
+  program = glCreateProgram();
+  glAttachShader(program, vs);
+  glAttachShader(program, fs);
+  glLinkProgram(program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  glUseProgram(program);
+  glUniform1i(glGetUniformLocation(program, "shades"), 0);
+  palette_location = glGetUniformLocation(program, "palette");
+  glUseProgram(0);
+
+  // Attribute-less draw, core profile still wants a VAO bound
+  glGenVertexArrays(1, &vao);
+
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, id, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+void FrameTexture::SetPalette(const u32 new_palette[4]) {
+  for(int i = 0; i < 4; i++) {
+    for(int c = 0; c < 4; c++) {
+      palette[i][c] = ((new_palette[i] >> (24 - c * 8)) & 0xff) / 255.f;
+    }
+  }
+
+  if(shades) {
+    Convert();
+  }
+}
+
+void FrameTexture::Convert() {
+  GLint viewport[4];
+  glGetIntegerv(GL_VIEWPORT, viewport);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glViewport(0, 0, WIDTH, HEIGHT);
+  glUseProgram(program);
+  glUniform4fv(palette_location, 4, &palette[0][0]);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, shades);
+  glBindVertexArray(vao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+
+  glBindVertexArray(0);
+  glUseProgram(0);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+}
+
+void FrameTexture::Upload(const u8* frame) {
+  unsigned int pbo = pbos[next];
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+
+  if(persistent) {
+    // Three frames back, the GPU is long done with it unless the driver queues very deep
+    if(fences[next]) {
+      glClientWaitSync(fences[next], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+      glDeleteSync(fences[next]);
+      fences[next] = nullptr;
+    }
+    memcpy(mapped[next], frame, size);
+  } else {
+    // Orphaning hands the old storage to the driver instead of waiting for it
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+    void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if(dst) {
+      memcpy(dst, frame, size);
+    }
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+
+  if(shades) {
+    glBindTexture(GL_TEXTURE_2D, shades);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+  } else {
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, nullptr);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  if(persistent) {
+    fences[next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  }
+  next = (next + 1) % PBO_COUNT;
+
+  if(shades) {
+    Convert();
+  }
+}
+
+void FrameTexture::UploadRows(int first, int count, const u8* rows) {
+  if(shades) {
+    glBindTexture(GL_TEXTURE_2D, shades);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, WIDTH, count, GL_RED, GL_UNSIGNED_BYTE, rows);
+    Convert();
+  } else {
+    glBindTexture(GL_TEXTURE_2D, id);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, first, WIDTH, count, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, rows);
+  }
+}
+} // natsukashii::frontend
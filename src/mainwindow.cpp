@@ -1,8 +1,10 @@
 #include "mainwindow.h"
+#include <sstream>
 
 namespace natsukashii::frontend
 {
 MainWindow::~MainWindow() {
+  texture.Destroy();
   ImGui_ImplOpenGL3_Shutdown();
   ImGui_ImplGlfw_Shutdown();
   ImGui::DestroyContext();
@@ -26,6 +28,27 @@ constexpr std::array<KeySaveState, 10> loadstate_buttons{
   std::make_pair(GLFW_KEY_F5,  5), std::make_pair(GLFW_KEY_F6, 6), std::make_pair(GLFW_KEY_F7, 7), std::make_pair(GLFW_KEY_F8, 8), std::make_pair(GLFW_KEY_F9, 9)
 };
 
+static u8 button_for_key(int key)
+{
+  switch(key) {
+    case GLFW_KEY_X: return BUTTON_A;
+    case GLFW_KEY_Z: return BUTTON_B;
+    case GLFW_KEY_RIGHT_SHIFT: return BUTTON_SELECT;
+    case GLFW_KEY_ENTER: return BUTTON_START;
+    case GLFW_KEY_RIGHT: return BUTTON_RIGHT;
+    case GLFW_KEY_LEFT: return BUTTON_LEFT;
+    case GLFW_KEY_UP: return BUTTON_UP;
+    case GLFW_KEY_DOWN: return BUTTON_DOWN;
+    default: return 0;
+  }
+}
+
+// What input events are stamped with and latencies are measured against, never 0
+static u64 host_time()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 static void glfw_error_callback(int error, const char* description)
 {
   fprintf(stderr, "Glfw Error %d: %s\n", error, description);
@@ -33,16 +56,28 @@ static void glfw_error_callback(int error, const char* description)
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
+  if(key == GLFW_KEY_TAB) {
+    g_window->core->turbo_hold = action != GLFW_RELEASE;
+    return;
+  }
+
+  if(u8 button = button_for_key(key)) {
+    if(action != GLFW_REPEAT) {
+      g_window->core->PressButton(button, action == GLFW_PRESS, host_time());
+    }
+    return;
+  }
+
   if(action == GLFW_PRESS) {
-    g_window->core->key = key;
     switch(key) {
       case GLFW_KEY_O: g_window->OpenFile(); break;
       case GLFW_KEY_S: g_window->core->Stop(); break;
       case GLFW_KEY_R: g_window->core->Reset(); break;
       case GLFW_KEY_P: g_window->core->Pause(); break;
+      case GLFW_KEY_U: g_window->core->turbo_unlimited = !g_window->core->turbo_unlimited; break;
       case GLFW_KEY_Q:
+        // Run shuts the emu thread down once the loop ends
         glfwSetWindowShouldClose(window, GLFW_TRUE);
-        g_window->core->Stop();
         break;
     }
     
@@ -55,8 +90,6 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         g_window->core->LoadState(loadstate_buttons[i].second);
       }
     }
-  } else if(action == GLFW_RELEASE) {
-    g_window->core->key = 0;
   }
 }
 
@@ -81,7 +114,7 @@ MainWindow::MainWindow(std::string title) : file("config.ini") {
   glfwSetWindowPos(window, details->width / 2 - w / 2, details->height / 2 - h / 2);
 
   glfwMakeContextCurrent(window);
-  glfwSwapInterval(0);
+  glfwSwapInterval(1); // The emu thread keeps its own pace, presenting faster than the display is wasted work
 
   glfwSetKeyCallback(window, key_callback);
 
@@ -101,24 +134,60 @@ MainWindow::MainWindow(std::string title) : file("config.ini") {
   if (!file.read(ini)) {
     ini["emulator"]["skip"] = "false";
     ini["emulator"]["bootrom"] = "bootrom.bin";
+    ini["audio"]["backend"] = "sdl";
+    ini["audio"]["wav_path"] = "audio.wav";
+    ini["audio"]["offload"] = "false";
+    ini["video"]["offload"] = "false";
+    ini["video"]["gpu_palette"] = "false";
+    ini["video"]["palette"] = "FED018,D35600,5E1210,0D0405";
+    ini["video"]["beam_racing"] = "false";
+    ini["emulator"]["turbo_audio"] = "decimate";
     file.generate(ini);
   }
 
   bool skip = ini["emulator"]["skip"] == "true";
   std::string bootrom = ini["emulator"]["bootrom"];
   core = std::make_unique<Core>(skip, bootrom);
+  core->turbo_mute = ini["emulator"]["turbo_audio"] == "mute";
+  core->bus.apu.SetSink(OpenAudioSink(ini["audio"]["backend"], ini["audio"]["wav_path"]));
+  core->bus.apu.SetOffload(ini["audio"]["offload"] == "true");
+  bool gpu_palette = ini["video"]["gpu_palette"] == "true";
+  if(gpu_palette) {
+    core->bus.ppu.SetPixelFormat(PixelFormat::Shade8);
+  }
+  core->bus.ppu.SetRenderOffload(ini["video"]["offload"] == "true");
   
-  glGenTextures(1, &id);
-  glBindTexture(GL_TEXTURE_2D, id);
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, WIDTH, HEIGHT, 0, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, core->bus.ppu.pixels);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+  texture.Init(core->bus.ppu.GetPixelFormat(), core->bus.ppu.frames.Front());
+  if(gpu_palette && !ini["video"]["palette"].empty()) {
+    // Comma separated RRGGBB, lightest shade first
+    u32 palette[4];
+    std::copy(std::begin(colors), std::end(colors), palette);
+    std::stringstream entries(ini["video"]["palette"]);
+    std::string entry;
+    for(int i = 0; i < 4 && std::getline(entries, entry, ','); i++) {
+      palette[i] = ((u32)strtoul(entry.c_str(), nullptr, 16) << 8) | 0xff;
+    }
+    texture.SetPalette(palette);
+  }
+
+  // Run sleeps until there's input or the emu thread has something new to show
+  auto wake = [this] {
+    emu_woke = true;
+    glfwPostEmptyEvent();
+  };
+  core->bus.ppu.frames.on_publish = wake;
+  core->on_command = wake;
+
+  if(ini["video"]["beam_racing"] == "true") {
+    bands = std::make_unique<ScanoutBands>(core->bus.ppu.GetPixelFormat());
+    bands->on_band = wake;
+    core->bus.ppu.SetLineCallback([this](u8 ly, const u8* row) { bands->Line(ly, row); });
+    // Every band is presented as soon as it's there, waiting for the display's refresh would undo it
+    glfwSwapInterval(0);
+  }
 
   NFD_Init();
   emu_thread = std::thread([&] { core->RunAsync(); } ); // Wake up emulator thread
-  emu_thread.detach();
 }
 
 void MainWindow::OpenFile() {
@@ -131,12 +200,29 @@ void MainWindow::OpenFile() {
 }
 
 void MainWindow::UpdateTexture() {
-  glBindTexture(GL_TEXTURE_2D, id);
-  glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, WIDTH, HEIGHT, GL_RGBA, GL_UNSIGNED_INT_8_8_8_8, core->bus.ppu.pixels);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+  // Fast-forward only renders on request, one frame per frame shown
+  core->bus.ppu.RequestFrame();
+  if(bands) {
+    while(bands->Pop(band)) {
+      texture.UploadRows(band.first, band.count, band.rows.data());
+    }
+  }
+
+  // Nothing new when frames are being skipped, keep presenting the last one
+  if(!core->bus.ppu.frames.Acquire()) {
+    return;
+  }
+
+  if(u64 tag = core->bus.ppu.frames.FrontTag()) {
+    presented_input = tag;
+  }
+
+  // Beam racing already showed it line by line, only frames that were never drawn (cleared by a stop) are left
+  if(bands && core->init) {
+    return;
+  }
+
+  texture.Upload(core->bus.ppu.frames.Front());
 }
 
 ImVec2 image_size;
@@ -154,31 +240,43 @@ static void resize_callback(ImGuiSizeCallbackData* data) {
   image_size = ImVec2(x, y);
 }
 
+// Seconds Run sleeps at most when nothing wakes it
+constexpr double IDLE_TIMEOUT = 0.25;
+
 void MainWindow::Run() {
   ImGuiIO& io = ImGui::GetIO(); (void)io;
-  
+  // Frames to draw without waiting first, ImGui needs one more after input to settle (menus, hovering)
+  int redraws = 1;
+
   while(!glfwWindowShouldClose(window)) {
-    u32 frameStartTicks = SDL_GetTicks();
+    if(redraws > 0) {
+      redraws--;
+      glfwPollEvents();
+    } else {
+      // Block until input, a published frame or an executed command. The timeout only keeps the
+      // stats moving while the watchdog skips frames, when nothing runs a timeout draws nothing
+      double start = glfwGetTime();
+      glfwWaitEventsTimeout(IDLE_TIMEOUT);
+      bool woken = glfwGetTime() - start < IDLE_TIMEOUT;
+      bool from_emu = emu_woke.exchange(false);
+      if(!woken && !(core->init && !core->pause)) {
+        continue;
+      }
 
-    if(core->init && !core->pause) {
-      PingEmuThread();
+      if(woken && !from_emu) {
+        redraws = 1;
+      }
     }
 
     ImGui_ImplOpenGL3_NewFrame();
     ImGui_ImplGlfw_NewFrame();
     ImGui::NewFrame();
 
-    glfwPollEvents();
-
-    if(core->bus.ppu.render) {
-      core->bus.ppu.render = false;
-    }
-    
     UpdateTexture();
 
     ImGui::SetNextWindowSizeConstraints(ImVec2(0, 0), ImVec2(FLT_MAX, FLT_MAX), resize_callback);
     ImGui::Begin("Image", nullptr, ImGuiWindowFlags_NoTitleBar);
-    ImGui::Image(reinterpret_cast<void*>(static_cast<intptr_t>(id)), image_size);
+    ImGui::Image(reinterpret_cast<void*>(static_cast<intptr_t>(texture.id)), image_size);
     ImGui::End();
 
     MenuBar();
@@ -194,13 +292,43 @@ void MainWindow::Run() {
     ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
     glfwSwapBuffers(window);
 
-    if(core->init && !core->pause) {
-      WaitEmuThread();
+    // Returns once the frame is queued for display, which is as close to the photons as GL lets us see
+    if(presented_input) {
+      latency.Add((host_time() - presented_input) / 1e6f);
+      presented_input = 0;
     }
-    
-    //while ((SDL_GetTicks() - frameStartTicks) < (1000 / 60))
-    SDL_Delay(1);
   }
+
+  // Quitting stops like Stop does, which saves the cartridge RAM. The core only goes once nothing runs it
+  core->Quit().wait();
+  emu_thread.join();
+  core.reset();
+}
+
+void LatencyHistogram::Add(float ms) {
+  samples[next] = ms;
+  next = (next + 1) % SAMPLES;
+  count = std::min(count + 1, SAMPLES);
+}
+
+void LatencyHistogram::Draw() {
+  if(!count) {
+    ImGui::Text("No input has reached the screen yet");
+    return;
+  }
+
+  float bins[BINS]{};
+  float sum = 0, worst = 0;
+  for(int i = 0; i < count; i++) {
+    bins[std::min(int(samples[i] / BIN_MS), BINS - 1)]++;
+    sum += samples[i];
+    worst = std::max(worst, samples[i]);
+  }
+
+  float last = samples[(next + SAMPLES - 1) % SAMPLES];
+  ImGui::Text("Last %.1f ms | Mean %.1f ms | Worst %.1f ms over %d inputs", last, sum / count, worst, count);
+  ImGui::PlotHistogram("##latency", bins, BINS, 0, nullptr, 0, FLT_MAX, ImVec2(BINS * 12, 80));
+  ImGui::Text("0 to %.0f ms in %.0f ms bins, the last one catches everything slower", BINS * BIN_MS, BIN_MS);
 }
 
 void MainWindow::MenuBar()
@@ -217,7 +345,6 @@ void MainWindow::MenuBar()
       if(ImGui::MenuItem("Exit"))
       {
         running = false;
-        core.reset();
         glfwSetWindowShouldClose(window, GLFW_TRUE);
       }
       ImGui::EndMenu();
@@ -237,25 +364,33 @@ void MainWindow::MenuBar()
 
       if(ImGui::MenuItem("Stop"))
       {
-        core->Stop();
+        core->Stop().wait();
         UpdateTexture();
       }
 
+      if(ImGui::MenuItem("Unlimited speed", "U", core->turbo_unlimited.load()))
+      {
+        core->turbo_unlimited = !core->turbo_unlimited;
+      }
+
       ImGui::EndMenu();
     }
-    ImGui::EndMainMenuBar();
-  }
-}
 
-void MainWindow::PingEmuThread() {
-  std::lock_guard <std::mutex> lock (core->emu_mutex);
-  
-  core->run_emu_thread = true;
-  core->emu_condition_variable.notify_one();
-}
+    if(ImGui::BeginMenu("Latency"))
+    {
+      latency.Draw();
+      ImGui::EndMenu();
+    }
 
-void MainWindow::WaitEmuThread() {
-  while (core->run_emu_thread) {}
+    if(core && core->init)
+    {
+      ImGui::Separator();
+      ImGui::Text("Speed %.1fx | Audio %.1f ms | Underruns %u | Pacing %+.2f ms | Rate %.4f | Work %.1f ms | Skipped %u",
+        core->stats.speed.load(), core->stats.buffer_ms.load(), core->stats.underruns.load(),
+        core->stats.error_ms.load(), core->stats.ratio.load(), core->stats.work_ms.load(), core->stats.skipped.load());
+    }
+    ImGui::EndMainMenuBar();
+  }
 }
 
 } // natsukashii::frontend
\ No newline at end of file
@@ -0,0 +1,24 @@
+#include "scanout.h"
+#include <string.h>
+
+namespace natsukashii::frontend
+{
+ScanoutBands::ScanoutBands(PixelFormat format) : row_size(FrameSize(format) / HEIGHT) { }
+
+void ScanoutBands::Line(u8 ly, const u8* row) {
+  int offset = ly % BAND_LINES;
+  staging.first = ly - offset;
+  staging.count = offset + 1;
+  memcpy(&staging.rows[offset * row_size], row, row_size);
+
+  if(offset == BAND_LINES - 1 || ly == HEIGHT - 1) {
+    if(ready.Push(&staging, 1) && on_band) {
+      on_band();
+    }
+  }
+}
+
+bool ScanoutBands::Pop(Band& band) {
+  return ready.Pop(&band, 1) != 0;
+}
+} // natsukashii::frontend
@@ -0,0 +1,88 @@
+#include "sdlsink.h"
+#include <string.h>
+
+namespace natsukashii::frontend
+{
+std::unique_ptr<AudioSink> OpenAudioSink(const std::string& backend, const std::string& wav_path) {
+  if(backend == "null") {
+    return std::make_unique<NullSink>();
+  }
+
+  if(backend == "wav") {
+    if(auto sink = WavSink::Open(wav_path.empty() ? "audio.wav" : wav_path)) {
+      return sink;
+    }
+    printf("Failed to create %s, audio is discarded\n", wav_path.c_str());
+    return std::make_unique<NullSink>();
+  }
+
+  if(auto sink = SdlSink::Open()) {
+    return sink;
+  }
+  printf("Failed to open audio device: %s, audio is discarded\n", SDL_GetError());
+  return std::make_unique<NullSink>();
+}
+
+std::unique_ptr<SdlSink> SdlSink::Open() {
+  if(SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
+    return nullptr;
+  }
+
+  std::unique_ptr<SdlSink> sink(new SdlSink);
+  SDL_AudioSpec want = {
+    .freq = FREQUENCY,
+    .format = AUDIO_F32SYS,
+    .channels = CHANNELS,
+    .samples = SAMPLES,
+    .callback = Callback,
+    .userdata = sink.get(),
+  }, have;
+
+  // Take whatever rate the device runs at natively, Blip resamples to it
+  sink->device = SDL_OpenAudioDevice(nullptr, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+  if(sink->device == 0) {
+    return nullptr;
+  }
+
+  sink->sample_rate = have.freq;
+  SDL_PauseAudioDevice(sink->device, 0);
+  return sink;
+}
+
+SdlSink::~SdlSink() {
+  if(device) {
+    SDL_CloseAudioDevice(device);
+  }
+}
+
+// Pull side of the ring, runs on SDL's audio thread. Never waits: whatever is missing
+// on an underrun is a short fade from the last played sample down to silence
+void SdlSink::Callback(void* userdata, Uint8* stream, int len) {
+  SdlSink* sink = (SdlSink*)userdata;
+  float* out = (float*)stream;
+  size_t wanted = len / sizeof(float);
+  size_t got = sink->ring.Pop(out, wanted);
+
+  if(got >= CHANNELS) {
+    memcpy(sink->last_sample, &out[got - CHANNELS], sizeof(sink->last_sample));
+  }
+
+  if(got < wanted) {
+    sink->underruns++;
+    for(size_t i = got; i < wanted; i += CHANNELS) {
+      for(int c = 0; c < CHANNELS; c++) {
+        sink->last_sample[c] *= 0.95f;
+        out[i + c] = sink->last_sample[c];
+      }
+    }
+  }
+}
+
+void SdlSink::Push(const float* samples, size_t frames) {
+  ring.Push(samples, frames * CHANNELS);
+}
+
+u32 SdlSink::Queued() {
+  return ring.Size() / CHANNELS;
+}
+} // natsukashii::frontend
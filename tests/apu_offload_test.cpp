@@ -0,0 +1,92 @@
+// Feeds the same register writes and sequencer ticks to an inline and an offloaded Apu and checks
+// that both produce exactly the same samples
+#include <apu.h>
+#include <random>
+
+using namespace natsukashii::core;
+
+constexpr int CYCLES_PER_FRAME = 70224;
+constexpr int FRAMES = 120;
+
+// Keeps everything, Push comes from the worker thread when offloaded
+struct CaptureSink : AudioSink
+{
+  int SampleRate() const override { return FREQUENCY; }
+  void Push(const float* data, size_t frames) override {
+    samples.insert(samples.end(), data, data + frames * CHANNELS);
+  }
+  u32 Queued() override { return 0; }
+  bool Realtime() const override { return false; }
+
+  std::vector<float> samples;
+};
+
+static const u8 registers[] = {
+  0x10, 0x11, 0x12, 0x13, 0x14, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e,
+  0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+};
+
+static std::vector<float> run(bool offload) {
+  Apu apu(true);
+  auto sink = std::make_unique<CaptureSink>();
+  CaptureSink* capture = sink.get();
+  apu.SetSink(std::move(sink));
+  apu.SetOffload(offload);
+
+  std::mt19937 rng(1234);
+  Scheduler scheduler;
+  scheduler.push(Entry(8192, Event::APU));
+  apu.WriteIO(0xff26, 0x80);
+  apu.WriteIO(0xff24, 0x77);
+  apu.WriteIO(0xff25, 0xff);
+
+  u64 cycles = 0;
+  for(int frame = 0; frame < FRAMES; frame++) {
+    u64 frame_end = (u64)(frame + 1) * CYCLES_PER_FRAME;
+    while(cycles < frame_end) {
+      u8 step = 4 * (1 + rng() % 8);
+      cycles += step;
+      apu.Step(step);
+
+      while(scheduler.entries[0].time <= cycles) {
+        Entry entry = scheduler.entries[0];
+        scheduler.pop(1);
+        apu.DispatchEvents(entry.time, cycles, scheduler);
+      }
+
+      if(rng() % 64 == 0) {
+        u8 reg = registers[rng() % sizeof(registers)];
+        apu.WriteIO(0xff00 | reg, rng());
+      }
+    }
+
+    apu.EndFrame();
+  }
+
+  // Joins the worker, everything it was sent has reached the sink after this
+  apu.SetOffload(false);
+  return capture->samples;
+}
+
+int main() {
+  std::vector<float> inline_samples = run(false);
+  std::vector<float> offloaded_samples = run(true);
+
+  bool audible = false;
+  for(float sample : inline_samples) {
+    audible |= sample != 0;
+  }
+
+  if(!audible) {
+    printf("FAIL: the register log produced only silence\n");
+    return 1;
+  }
+
+  if(inline_samples != offloaded_samples) {
+    printf("FAIL: %zu inline samples, %zu offloaded, contents differ\n", inline_samples.size(), offloaded_samples.size());
+    return 1;
+  }
+
+  printf("OK: %zu samples identical\n", inline_samples.size());
+  return 0;
+}
@@ -0,0 +1,179 @@
+// Drives the same VRAM/OAM/register writes into inline and offloaded Ppus, at render intervals 1 and 2,
+// and checks that every published front buffer matches the inline interval 1 frame. The LCD is
+// switched off and back on now and then, inline Ppus have to draw exactly the frames their interval
+// picks counting from every frame start, re-enabling the LCD included
+#include <bus.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string.h>
+#include <thread>
+
+using namespace natsukashii::core;
+
+constexpr int FRAMES = 60;
+
+static const u8 registers[] = { 0x40, 0x42, 0x43, 0x45, 0x47, 0x48, 0x49, 0x4a, 0x4b };
+
+struct Setup
+{
+  const char* name;
+  bool offload;
+  u32 interval;
+};
+
+// The first one is the reference, each offloaded setup follows the inline one with the same interval
+static const Setup setups[] = {
+  { "inline", false, 1 },
+  { "offloaded", true, 1 },
+  { "inline every 2nd", false, 2 },
+  { "offloaded every 2nd", true, 2 },
+};
+constexpr int SETUPS = sizeof(setups) / sizeof(setups[0]);
+
+// Offloaded frames come from the worker whenever it catches up
+static bool WaitFrame(TripleBuffer& frames) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while(!frames.Acquire()) {
+    if(std::chrono::steady_clock::now() > deadline) {
+      return false;
+    }
+
+    std::this_thread::yield();
+  }
+
+  return true;
+}
+
+int main() {
+  // Skipping the boot ROM, Mem still wants one to load
+  std::string bootrom = (std::filesystem::temp_directory_path() / "natsukashii_test_bootrom.bin").string();
+  std::ofstream(bootrom, std::ios::binary) << std::string(256, '\0');
+
+  std::vector<std::unique_ptr<Bus>> buses;
+  std::vector<Scheduler> schedulers(SETUPS);
+  for(int i = 0; i < SETUPS; i++) {
+    buses.push_back(std::make_unique<Bus>(true, bootrom));
+    buses[i]->ppu.SetRenderInterval(setups[i].interval);
+    buses[i]->ppu.SetRenderOffload(setups[i].offload);
+    // The blank frame from construction
+    buses[i]->ppu.frames.Acquire();
+    schedulers[i].push(Entry(80, Event::PPU));
+  }
+
+  size_t size = FrameSize(buses[0]->ppu.GetPixelFormat());
+  std::mt19937 rng(7);
+  int failures = 0, compared = 0;
+  u64 cycles = 0;
+  // Frame starts seen on the first bus: line 153 wrapping to 0 and the LCD coming back on
+  u32 starts = 0;
+  u8 last_ly = 0;
+  bool lcd_on = true;
+
+  for(int frame = 0; frame < FRAMES && !failures;) {
+    cycles += 4;
+
+    // The same writes go to every bus
+    u16 addr = 0;
+    u8 val = 0;
+    switch(rng() % 64) {
+    case 0 ... 20:
+      addr = 0x8000 | (rng() & 0x1fff);
+      val = rng();
+      break;
+    case 21:
+      addr = 0xfe00 | (rng() % 0xa0);
+      val = rng() % 170;
+      break;
+    case 22:
+      if(rng() % 16 == 0) {
+        addr = 0xff00 | registers[rng() % sizeof(registers)];
+        val = rng();
+        // Mostly on, off stops VBlank until the next LCDC write
+        if(addr == 0xff40 && rng() % 8) {
+          val |= 0x80;
+        }
+      }
+      break;
+    }
+
+    bool vblank = false;
+    for(int i = 0; i < SETUPS; i++) {
+      Bus& bus = *buses[i];
+      if(addr) {
+        bus.WriteByte(addr, val);
+      }
+
+      Scheduler& scheduler = schedulers[i];
+      while(scheduler.entries[0].time <= cycles) {
+        Entry entry = scheduler.entries[0];
+        scheduler.pop(1);
+        bus.ppu.DispatchEvents(entry.time, scheduler, bus.mem.io.intf);
+      }
+
+      bool entered = bus.mem.io.intf & 1;
+      bus.mem.io.intf = 0;
+      if(i && entered != vblank) {
+        printf("FAIL: %s is out of step with %s\n", setups[i].name, setups[0].name);
+        return 1;
+      }
+
+      vblank = entered;
+    }
+
+    bool on = buses[0]->ReadByte(0xff40) & 0x80;
+    u8 ly = buses[0]->ReadByte(0xff44);
+    starts += on && (!lcd_on || (last_ly == 153 && ly == 0));
+    lcd_on = on;
+    last_ly = ly;
+
+    if(!vblank) {
+      continue;
+    }
+
+    frame++;
+    const u8* reference = nullptr;
+    bool drawn = false;
+    for(int i = 0; i < SETUPS; i++) {
+      TripleBuffer& frames = buses[i]->ppu.frames;
+      if(!setups[i].offload) {
+        drawn = frames.Acquire();
+        if(drawn != (starts % setups[i].interval == 0)) {
+          printf("FAIL: %s %s frame %d\n", setups[i].name, drawn ? "drew" : "skipped", frame);
+          failures++;
+          continue;
+        }
+      } else if(drawn && !WaitFrame(frames)) {
+        printf("FAIL: %s never published frame %d\n", setups[i].name, frame);
+        failures++;
+        continue;
+      }
+
+      if(!drawn) {
+        continue;
+      }
+
+      if(!reference) {
+        reference = frames.Front();
+        continue;
+      }
+
+      compared++;
+      if(memcmp(frames.Front(), reference, size)) {
+        printf("FAIL: %s differs from %s in frame %d\n", setups[i].name, setups[0].name, frame);
+        failures++;
+      }
+    }
+  }
+
+  buses.clear();
+  std::filesystem::remove(bootrom);
+
+  if(failures) {
+    return 1;
+  }
+
+  printf("OK: %d frames identical\n", compared);
+  return 0;
+}